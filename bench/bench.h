@@ -0,0 +1,70 @@
+ /*
+   Shared harness for the component microbenchmarks
+   Each benchmark is its own program that includes the compiler with its
+   main() left out, so it measures exactly the code the compiler runs.
+   Every case does a fixed amount of work on deterministic input and is
+   repeated; the median repetition is reported, with hardware events per
+   operation when perf_event_open is available. Lines have the form
+ 
+     suite/case  ops=N  ns/op=X  cycles/op=X  instructions/op=X  branch-misses/op=X
+ 
+   so results from two commits can be compared line by line.
+ */
+ #define SIMPLELANG_NO_MAIN
+ #include "../compiler.c"
+ 
+ #define BENCH_MAX_REPS 101
+ 
+ typedef void (*BenchFn)(void *arg, long ops);
+ 
+ int benchReps = 11;            // Repetitions per case, first argument of each benchmark
+ 
+  // Read the repetition count and open the hardware counters
+ void benchInit(int argc, char *argv[]) {
+     if (argc > 1) benchReps = atoi(argv[1]);
+     if (benchReps < 1 || benchReps > BENCH_MAX_REPS) {
+         fprintf(stderr, "Error: Repetitions must be 1 to %d\n", BENCH_MAX_REPS);
+         exit(1);
+     }
+     perfOpen();
+ }
+ 
+ int compareDouble(const void *a, const void *b) {
+     double x = *(const double *)a, y = *(const double *)b;
+     return (x > y) - (x < y);
+ }
+ 
+  // Print one hardware event per operation, or n/a
+ void benchEvent(PerfEvent e, const uint64_t *before, const uint64_t *after, long ops) {
+     if (perfFds[e] < 0) printf("  %s/op=n/a", perfNames[e]);
+     else printf("  %s/op=%.2f", perfNames[e], (double)(after[e] - before[e]) / ops / benchReps);
+ }
+ 
+ /*
+   Run one case
+   fn does ops operations per call; one untimed call warms the caches
+ */
+ void benchRun(const char *name, BenchFn fn, void *arg, long ops) {
+     double times[BENCH_MAX_REPS];
+     uint64_t before[PERF_COUNT], after[PERF_COUNT];
+     fn(arg, ops);
+     perfRead(before);
+     for (int r = 0; r < benchReps; r++) {
+         double start = nowSeconds();
+         fn(arg, ops);
+         times[r] = nowSeconds() - start;
+     }
+     perfRead(after);
+     qsort(times, benchReps, sizeof(double), compareDouble);
+ 
+     printf("%-32s  ops=%ld  ns/op=%.2f", name, ops, times[benchReps / 2] * 1e9 / ops);
+     benchEvent(PERF_CYCLES, before, after, ops);
+     benchEvent(PERF_INSTRUCTIONS, before, after, ops);
+     benchEvent(PERF_BRANCH_MISSES, before, after, ops);
+     printf("\n");
+ }
+ 
+  // Note once why hardware events are missing
+ void benchDone(void) {
+     if (perfError) fprintf(stderr, "Hardware counters unavailable: %s\n", perfError);
+ }
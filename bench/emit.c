@@ -0,0 +1,40 @@
+ /*
+   Code buffer
+   emit parsing formatted lines into the assembly buffer, and formatInstr
+   turning them back into text; ops are lines
+ */
+ #include "bench.h"
+ 
+ void emitLines(void *arg, long ops) {
+     (void)arg;
+     for (long i = 0; i < ops; i++) {
+         if (asmLine == MAX_CODE_LINES) asmLine = 0;
+         switch (i & 3) {
+             case 0: emit("LDA %d", 16 + (int)(i & 63)); break;
+             case 1: emit("ADDI %d", (int)(i & 255)); break;
+             case 2: emit("L%ld:", i); break;
+             default: emit("JNZ L%ld", i); break;
+         }
+     }
+ }
+ 
+ void formatLines(void *arg, long ops) {
+     char text[200];
+     long sum = 0;
+     (void)arg;
+     for (long i = 0; i < ops; i++) {
+         formatInstr(&assembly[i % asmLine], text, sizeof(text));
+         sum += text[0];
+     }
+     if (sum == 0) fprintf(stderr, "Error: Nothing formatted\n");
+ }
+ 
+ int main(int argc, char *argv[]) {
+     benchInit(argc, argv);
+     benchRun("emit/emit", emitLines, NULL, 100000);
+     asmLine = 0;
+     emitLines(NULL, MAX_CODE_LINES);
+     benchRun("emit/format", formatLines, NULL, 100000);
+     benchDone();
+     return 0;
+ }
@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+#  --jobs determinism check
+#  Compiles generated programs with -O at --jobs=1 and --jobs=N and fails if
+#  output.asm or the simulated final state differ. Usage (from the repo root):
+#
+#    sh bench/jobs_check.sh [N] [programs] [statements]
+#
+#  Defaults: N=4, 50 programs of 100 statements. Programs read and write a
+#  UART at 240 so the simulation follows random input bytes; the few that
+#  do not fit in the assembly buffer are skipped.
+
+jobs=${1:-4}
+count=${2:-50}
+size=${3:-100}
+root=$(pwd)
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 -pthread "$root/compiler.c" -o "$work/compiler" || exit 1
+cd "$work" || exit 1
+head -c 4096 /dev/urandom > in.bin
+
+# One random program: if/switch nesting, device reads and writes, constants
+# and arithmetic over 20 variables
+generate() {
+    awk -v seed="$1" -v size="$2" '
+    function pick() { return "v" int(rand() * 20) }
+    function stmt(depth,    k, s, n, i, used, v) {
+        k = rand()
+        if (k < 0.15 && depth < 2) {
+            s = "if (" pick() " == " int(rand() * 6) ") {"
+            n = 1 + int(rand() * 2)
+            for (i = 0; i < n; i++) s = s " " stmt(depth + 1)
+            return s " }"
+        }
+        if (k < 0.22 && depth < 2) {
+            s = "switch (" pick() ") {"
+            split("", used)
+            n = 1 + int(rand() * 4)
+            for (i = 0; i < n; i++) {
+                v = int(rand() * 12)
+                if (v in used) continue
+                used[v] = 1
+                s = s " case " v ": " stmt(depth + 1)
+            }
+            return s " default: " stmt(depth + 1) " }"
+        }
+        if (k < 0.27) return pick() " = dev;"
+        if (k < 0.30) return "dev = " pick() ";"
+        if (k < 0.50) return pick() " = " int(rand() * 256) ";"
+        return pick() " = " pick() " + " pick() " - " int(rand() * 9) ";"
+    }
+    BEGIN {
+        srand(seed)
+        print "int dev @ 240;"
+        for (i = 0; i < 20; i++) print "int v" i ";"
+        for (i = 0; i < size; i++) print stmt(0)
+    }'
+}
+
+status=0
+skipped=0
+for seed in $(seq 1 "$count"); do
+    generate "$seed" "$size" > input.sl
+    if ! ./compiler -O --jobs=1 --simulate --uart=240,in.bin > /dev/null 2> sim1.txt; then
+        if grep -q "Too many lines" sim1.txt; then skipped=$((skipped + 1)); continue; fi
+        echo "seed $seed: compile failed"; status=1; continue
+    fi
+    mv output.asm one.asm
+    ./compiler -O --jobs="$jobs" --simulate --uart=240,in.bin > /dev/null 2> simN.txt || { echo "seed $seed: compile failed at --jobs=$jobs"; status=1; continue; }
+    cmp -s one.asm output.asm || { echo "seed $seed: output.asm differs"; status=1; }
+    grep '^  ' sim1.txt > state1.txt
+    grep '^  ' simN.txt > stateN.txt
+    cmp -s state1.txt stateN.txt || { echo "seed $seed: simulated state differs"; status=1; }
+done
+[ $status -eq 0 ] && echo "$((count - skipped)) programs ($skipped too large): same code and state at --jobs=1 and --jobs=$jobs"
+exit $status
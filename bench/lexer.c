@@ -0,0 +1,62 @@
+ /*
+   Lexer throughput
+   getNextToken over synthetic source that is mostly identifiers, mostly
+   numbers, or mostly whitespace; ops are tokens
+ */
+ #include "bench.h"
+ 
+ #define SOURCE_TOKENS 20000
+ 
+ typedef struct {
+     char *text;
+     size_t size;
+ } Source;
+ 
+  // Lex the whole source once; ops is the token count it was built with
+ void lexSource(void *arg, long ops) {
+     Source *src = arg;
+     FILE *file = fmemopen(src->text, src->size, "r");
+     if (!file) {
+         perror("Error opening source buffer");
+         exit(1);
+     }
+     hasToken = 0;
+     sourceLine = 1;
+     long count = 0;
+     while (getNextToken(file).type != TOKEN_EOF) count++;
+     fclose(file);
+     if (count != ops) {
+         fprintf(stderr, "Error: Lexed %ld tokens, expected %ld\n", count, ops);
+         exit(1);
+     }
+ }
+ 
+  // Build a source of SOURCE_TOKENS tokens; kind picks what dominates
+ Source makeSource(char kind) {
+     static const char *words[] = { "alpha", "counter", "x", "value2", "total", "flagBit", "if", "int" };
+     Source src = { malloc(SOURCE_TOKENS * 64), 0 };
+     unsigned seed = 12345;  // Fixed, so every commit lexes the same text
+     for (int t = 0; t < SOURCE_TOKENS; t++) {
+         seed = seed * 1103515245 + 12345;
+         unsigned r = seed >> 16;
+         if (kind == 'i') {
+             src.size += sprintf(src.text + src.size, "%s%s", t % 4 == 3 ? "=" : words[r % 8], r % 3 ? " " : "\n");
+         } else if (kind == 'n') {
+             if (t % 4 == 3) src.size += sprintf(src.text + src.size, "+ ");
+             else src.size += sprintf(src.text + src.size, "%u ", r % 100000);
+         } else {
+             src.size += sprintf(src.text + src.size, "%s%*s\n\t", t % 2 ? ";" : "a", (int)(r % 40), "");
+         }
+     }
+     return src;
+ }
+ 
+ int main(int argc, char *argv[]) {
+     benchInit(argc, argv);
+     Source identifiers = makeSource('i'), numbers = makeSource('n'), whitespace = makeSource('w');
+     benchRun("lexer/identifiers", lexSource, &identifiers, SOURCE_TOKENS);
+     benchRun("lexer/numbers", lexSource, &numbers, SOURCE_TOKENS);
+     benchRun("lexer/whitespace", lexSource, &whitespace, SOURCE_TOKENS);
+     benchDone();
+     return 0;
+ }
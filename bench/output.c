@@ -0,0 +1,33 @@
+ /*
+   Output writer
+   writeAssembly on a full code buffer into a file in /tmp, including the
+   fclose that flushes it; ops are lines written
+ */
+ #include "bench.h"
+ 
+ void writeFile(void *arg, long ops) {
+     const char *path = arg;
+     FILE *out = fopen(path, "w");
+     if (!out) {
+         perror("Error creating output file");
+         exit(1);
+     }
+     for (long done = 0; done < ops; done += asmLine) writeAssembly(out);
+     fclose(out);
+ }
+ 
+ int main(int argc, char *argv[]) {
+     char path[64];
+     benchInit(argc, argv);
+     snprintf(path, sizeof(path), "/tmp/simplelang-bench-%d.asm", (int)getpid());
+     asmLine = 0;
+     for (int i = 0; i < MAX_CODE_LINES; i++) {
+         if (i % 8 == 7) emit("L%d:", i);
+         else if (i % 2) emit("STA %d", 16 + i % 200);
+         else emit("LDA %d", 16 + i % 200);
+     }
+     benchRun("output/write", writeFile, path, 10 * MAX_CODE_LINES);
+     remove(path);
+     benchDone();
+     return 0;
+ }
@@ -0,0 +1,59 @@
+ /*
+   Symbol table
+   getVarAddress inserting N new names, then looking up names that exist;
+   ops are calls. The table holds at most MAX_VARS names (and data memory
+   has 240 cells), so sizes stop there.
+ */
+ #include "bench.h"
+ 
+ typedef struct {
+     int size;
+     char names[MAX_VARS][MAX_TOKEN_LEN];
+ } Names;
+ 
+  // Empty the symbol table
+ void resetSymbols(void) {
+     varCount = 0;
+     tempCount = 0;
+     currentAddress = 16;
+ }
+ 
+ void insertNames(void *arg, long ops) {
+     Names *n = arg;
+     for (long done = 0; done < ops; ) {
+         resetSymbols();
+         for (int i = 0; i < n->size && done < ops; i++, done++) getVarAddress(n->names[i]);
+     }
+ }
+ 
+ void lookupNames(void *arg, long ops) {
+     Names *n = arg;
+     unsigned seed = 777;
+     long sum = 0;
+     for (long i = 0; i < ops; i++) {
+         seed = seed * 1103515245 + 12345;
+         sum += getVarAddress(n->names[(seed >> 16) % n->size]);
+     }
+     if (sum == 0) fprintf(stderr, "Error: Lookups found nothing\n");
+ }
+ 
+ int main(int argc, char *argv[]) {
+     static const int sizes[] = { 10, 30, 100 };
+     static Names names;
+     benchInit(argc, argv);
+     for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+         char label[64];
+         names.size = sizes[s];
+         for (int i = 0; i < names.size; i++) snprintf(names.names[i], MAX_TOKEN_LEN, "var%dx%d", i * 7919 % 1000, i);
+ 
+         snprintf(label, sizeof(label), "symtab/insert/%d", names.size);
+         benchRun(label, insertNames, &names, 100000);
+ 
+         resetSymbols();
+         for (int i = 0; i < names.size; i++) getVarAddress(names.names[i]);
+         snprintf(label, sizeof(label), "symtab/lookup/%d", names.size);
+         benchRun(label, lookupNames, &names, 100000);
+     }
+     benchDone();
+     return 0;
+ }
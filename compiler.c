@@ -13,17 +13,41 @@
  #include <string.h>
  #include <ctype.h>
  #include <stdarg.h>
+ #include <time.h>
+ #include <stdint.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <pthread.h>
+ #include <errno.h>
+ #include <sys/resource.h>
+ #include <sys/file.h>
+ #ifdef __linux__
+ #include <linux/perf_event.h>
+ #include <sys/syscall.h>
+ #include <elf.h>
+ #include <signal.h>
+ #include <sys/time.h>
+ #endif
+ #ifdef __GLIBC__
+ #include <execinfo.h>
+ #endif
  
  // Constants for compiler limits 
  #define MAX_TOKEN_LEN 100    // Maximum length of a token
  #define MAX_VARS 100         // Maximum number of variables
  #define MAX_CODE_LINES 1000  // Maximum lines of assembly output
+ #define MAX_EXPR_NODES 256   // Maximum nodes in one expression tree
+ #define MAX_TEMPS 16         // Maximum scratch cells for expression temporaries
  
  // Token types for our language 
  typedef enum {
      TOKEN_INT, TOKEN_IDENTIFIER, TOKEN_NUMBER, TOKEN_ASSIGN,
      TOKEN_PLUS, TOKEN_MINUS, TOKEN_IF, TOKEN_EQUAL,
-     TOKEN_LPAREN, TOKEN_RPAREN, TOKEN_LBRACE, TOKEN_RBRACE, TOKEN_SEMICOLON,
+     TOKEN_LPAREN, TOKEN_RPAREN, TOKEN_LBRACE, TOKEN_RBRACE, TOKEN_SEMICOLON, TOKEN_AT,
+     TOKEN_Q4_4, TOKEN_Q8_8, TOKEN_PLUS_SAT, TOKEN_MINUS_SAT,
+     TOKEN_SWITCH, TOKEN_CASE, TOKEN_DEFAULT, TOKEN_COLON, TOKEN_COMMA,
      TOKEN_EOF, TOKEN_UNKNOWN
  } TokenType;
  
@@ -31,12 +55,21 @@
  typedef struct {
      TokenType type;      
      char text[MAX_TOKEN_LEN];  // Actual text of the token
+     int line;                  // Source line the token starts on
  } Token;
  
+ // Variable types: int wraps around; q4_4 and q8_8 are unsigned fixed-point
+ // numbers with 4 and 8 fraction bits. A q8_8 takes two cells, low byte first.
+ typedef enum { TYPE_INT, TYPE_Q4_4, TYPE_Q8_8 } VarType;
+ const char *varTypeNames[] = { "int", "q4_4", "q8_8" };
+ const int fractionBits[] = { 0, 4, 8 };
+ 
  // Structure to track variables in symbol table 
  typedef struct {
      char name[MAX_TOKEN_LEN];  // Variable name
      int address;               // Memory address for the variable
+     int isVolatile;            // Declared at a fixed address with '@' (memory-mapped I/O)
+     VarType type;              // Declared type
  } Variable;
  
  // Global variables for compiler state 
@@ -45,20 +78,483 @@
  int labelCount = 0;            // Counter for generating unique labels
  int currentAddress = 16;       // Next available memory address (starts at 16)
  
- char assembly[MAX_CODE_LINES][100];  // Buffer for generated assembly code
- int asmLine = 0;                     // Current line in assembly output
+ // Structure to represent one line of generated assembly 
+ typedef struct {
+     char op[8];                // Mnemonic (e.g. "LDA"), empty for a label
+     char arg[MAX_TOKEN_LEN];   // Operand, or the label name for a label
+     int line;                  // Source line that produced it
+ } Instr;
+ 
+ Instr program[MAX_CODE_LINES];                // Buffer for generated assembly code
+ _Thread_local Instr *assembly = program;      // Buffer the current thread works on
+ _Thread_local int asmLine = 0;                // Current line in assembly output
+ 
+ // Node of an expression tree ('n' number, 'v' variable, '+' or '-', and
+ // 'p' or 'm' for the saturating +| and -|) 
+ typedef struct {
+     char kind;
+     char text[MAX_TOKEN_LEN];  // Number or variable name for leaves
+     int left, right;           // Operand nodes for '+' and '-'
+ } ExprNode;
+ 
+ ExprNode nodes[MAX_EXPR_NODES];  // Tree of the expression being compiled
+ int nodeCount = 0;
+ VarType exprType = TYPE_INT;     // Type of the expression being compiled
+ 
+ // Scratch memory cell used for expression temporaries 
+ typedef struct {
+     int address;
+     int busy;                  // Holds a live value
+ } TempSlot;
+ 
+ TempSlot temps[MAX_TEMPS];     // Every scratch cell allocated so far
+ int tempCount = 0;
+ 
+ // Size, speed and energy of one instruction on the target CPU 
+ typedef struct {
+     const char *op;            // Mnemonic
+     int bytes;                 // Encoded size
+     int cycles;                // Clock cycles to execute
+     int energy;                // Estimated energy per execution, in pJ
+ } OpCost;
+ 
+ // Target CPU description consulted by cost-driven code generation 
+ // The loader that applies the ROM data table at reset is costed through
+ // pseudo-ops: .TABLE once per image, .RUN per run of consecutive
+ // addresses and .BYTE per initialized byte. Targets without them have no loader.
+ typedef struct {
+     const char *name;
+     const OpCost *costs;       // Terminated by an entry with op == NULL
+     int hasSkip;               // SKZ/SKNZ skip the next instruction if Z is set/clear
+     int branchPenalty;         // Extra cycles when a jump is taken
+     int hasShortBranch;        // 2-byte relative jumps besides the 3-byte absolute ones
+     int registers;             // Registers for variables; the code is lowered to 8080 when set
+     int stallEnergy;           // pJ per cycle spent on a branch penalty or a skipped instruction
+ } Target;
+ 
+ const OpCost sl8Costs[] = {
+     { "LDI", 2, 2, 18 }, { "LDA", 2, 3, 42 }, { "STA", 2, 3, 46 },
+     { "ADD", 2, 3, 44 }, { "ADDI", 2, 2, 20 }, { "SUB", 2, 3, 44 }, { "SUBI", 2, 2, 20 },
+     { "ADC", 2, 3, 44 }, { "ADCI", 2, 2, 20 }, { "SBC", 2, 3, 44 }, { "SBCI", 2, 2, 20 },
+     { "JMP", 3, 3, 24 }, { "JZ", 3, 3, 24 }, { "JNZ", 3, 3, 24 }, { "JC", 3, 3, 24 }, { "JNC", 3, 3, 24 },
+     { "JMPT", 3, 5, 60 },
+     { ".TABLE", 3, 6, 30 }, { ".RUN", 2, 4, 20 }, { ".BYTE", 1, 2, 28 },
+     { NULL, 0, 0, 0 }
+ };
+ const OpCost sl8pCosts[] = {
+     { "LDI", 2, 2, 18 }, { "LDA", 2, 3, 42 }, { "STA", 2, 3, 46 },
+     { "ADD", 2, 3, 44 }, { "ADDI", 2, 2, 20 }, { "SUB", 2, 3, 44 }, { "SUBI", 2, 2, 20 },
+     { "ADC", 2, 3, 44 }, { "ADCI", 2, 2, 20 }, { "SBC", 2, 3, 44 }, { "SBCI", 2, 2, 20 },
+     { "JMP", 3, 3, 24 }, { "JZ", 3, 3, 24 }, { "JNZ", 3, 3, 24 }, { "JC", 3, 3, 24 }, { "JNC", 3, 3, 24 },
+     { "JMPT", 3, 5, 60 },
+     { "SKZ", 1, 1, 9 }, { "SKNZ", 1, 1, 9 },
+     { ".TABLE", 3, 6, 30 }, { ".RUN", 2, 4, 20 }, { ".BYTE", 1, 2, 28 },
+     { NULL, 0, 0, 0 }
+ };
+ // Memory operands of ADD/SUB go through HL: LXI H,addr then ADD M
+ const OpCost i8080Costs[] = {
+     { "LDI", 2, 7, 60 }, { "LDA", 3, 13, 120 }, { "STA", 3, 13, 125 },
+     { "ADD", 4, 17, 160 }, { "ADDI", 2, 7, 60 }, { "SUB", 4, 17, 160 }, { "SUBI", 2, 7, 60 },
+     { "ADC", 4, 17, 160 }, { "ADCI", 2, 7, 60 }, { "SBC", 4, 17, 160 }, { "SBCI", 2, 7, 60 },
+     { "JMP", 3, 10, 85 }, { "JZ", 3, 10, 85 }, { "JNZ", 3, 10, 85 }, { "JC", 3, 10, 85 }, { "JNC", 3, 10, 85 },
+     { "JMPT", 17, 85, 765 },   // Index doubled in HL, added to the table address, then PCHL
+     { NULL, 0, 0, 0 }
+ };
+ const Target targets[] = {
+     { "sl8",   sl8Costs,   0, 0, 0, 0, 6 },   // The original accumulator CPU
+     { "sl8p",  sl8pCosts,  1, 4, 1, 0, 8 },   // Pipelined core: conditional skips, costly taken jumps, short jumps
+     { "i8080", i8080Costs, 0, 0, 0, 4, 9 },   // 8080 with B, C, D and E for variables
+ };
+ const Target *target = &targets[0];
+ 
+ // Machine encoding of an instruction 
+ #define OPERAND_NONE 0
+ #define OPERAND_BYTE 1         // Immediate value or data address
+ #define OPERAND_ABS16 2        // Absolute code address, low byte first
+ #define OPERAND_REL8 3         // Signed displacement from the next instruction
+ typedef struct {
+     const char *op;
+     unsigned char opcode;
+     int operand;
+ } Encoding;
+ 
+ const Encoding encodings[] = {
+     { "LDI", 0x10, OPERAND_BYTE }, { "LDA", 0x11, OPERAND_BYTE }, { "STA", 0x12, OPERAND_BYTE },
+     { "ADD", 0x20, OPERAND_BYTE }, { "ADDI", 0x21, OPERAND_BYTE },
+     { "SUB", 0x22, OPERAND_BYTE }, { "SUBI", 0x23, OPERAND_BYTE },
+     { "ADC", 0x24, OPERAND_BYTE }, { "ADCI", 0x25, OPERAND_BYTE },  // Add with carry in
+     { "SBC", 0x26, OPERAND_BYTE }, { "SBCI", 0x27, OPERAND_BYTE },  // Subtract with borrow in
+     { "JMP", 0x30, OPERAND_ABS16 }, { "JZ", 0x31, OPERAND_ABS16 }, { "JNZ", 0x32, OPERAND_ABS16 },
+     { "JC", 0x33, OPERAND_ABS16 }, { "JNC", 0x34, OPERAND_ABS16 },
+     { "JMPT", 0x35, OPERAND_ABS16 },  // Jump to the address at table + 2 * accumulator
+     { "JMPS", 0x38, OPERAND_REL8 }, { "JZS", 0x39, OPERAND_REL8 }, { "JNZS", 0x3A, OPERAND_REL8 },
+     { "JCS", 0x3B, OPERAND_REL8 }, { "JNCS", 0x3C, OPERAND_REL8 },
+     { "SKZ", 0x40, OPERAND_NONE }, { "SKNZ", 0x41, OPERAND_NONE },
+     { "HLT", 0xFF, OPERAND_NONE },
+     { NULL, 0, 0 }
+ };
+ 
+ #define MAX_IMAGE 65536
+ unsigned char image[MAX_IMAGE];     // Assembled machine code
+ int imageSize = 0;
+ int codeOrigin = 0;                 // Address of the first assembly line
+ int instrAddress[MAX_CODE_LINES];   // Code address of each assembly line
+ int longBranch[MAX_CODE_LINES];     // Jump uses the 3-byte absolute form
+ int padStart[MAX_CODE_LINES];       // Address of the padding before a pinned line, -1 if none
+ const char *binPath = NULL;         // --bin=FILE
+ int relaxReport = 0;                // --relax-report
+ const char *deltaPath = NULL;       // --delta=FILE, previous image to diff against
+ int pageSize = 64;                  // --page-size=N, flash page size for the delta
+ int pinSize = 0;                    // --pin=N, top-level statements start on N-byte boundaries
+ int reserveSize = 0;                // --reserve=N, bytes kept free between code and data table
+ 
+ // First source line of each top-level statement, where code can be pinned 
+ int statementLines[MAX_CODE_LINES];
+ int statementCount = 0;
  
  Token currentToken;            // Current token being processed
  int hasToken = 0;              // Flag indicating if we have a token pushed back
+ int sourceLine = 1;            // Line the lexer is currently reading
+ int tokenLine = 1;             // Line of the last token handed to the parser
+ const char *inputPath = "input.sl";  // Source file being compiled
+ 
+ // Counters exported by writeMetrics() 
+ typedef enum {
+     METRIC_COMPILES, METRIC_TOKENS, METRIC_STATEMENTS, METRIC_INSTRUCTIONS,
+     METRIC_STATE_HITS,
+     METRIC_COUNT
+ } MetricId;
+ 
+ // Compiler phases timed for the metrics report 
+ typedef enum {
+     PHASE_PARSE, PHASE_OPTIMIZE, PHASE_ASSEMBLE, PHASE_OUTPUT,
+     PHASE_COUNT
+ } Phase;
+ const char *phaseNames[] = { "parse", "optimize", "assemble", "output" };
+ 
+ long metricValues[METRIC_COUNT];    // Current value of each counter
+ double phaseSeconds[PHASE_COUNT];   // Wall time spent in each phase
+ double phaseStart;                  // Clock when the current phase began
+ 
+ // Hardware events counted per phase with --perf-counters 
+ typedef enum {
+     PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_BRANCH_MISSES,
+     PERF_COUNT
+ } PerfEvent;
+ const char *perfNames[] = { "cycles", "instructions", "L1d-misses", "LLC-misses", "branch-misses" };
+ int perfCounters = 0;               // --perf-counters
+ int perfFds[PERF_COUNT];            // Open counter per event, -1 when unavailable
+ const char *perfError = NULL;       // Why the first unavailable counter could not be opened
+ uint64_t perfStart[PERF_COUNT];     // Counts when the current phase began
+ uint64_t phaseEvents[PHASE_COUNT][PERF_COUNT];
+ const char *metricsPath = NULL;     // --metrics=FILE, NULL when disabled
+
+ // Sampling profiler of the compiler itself, --profile=FILE 
+ #define MAX_PROFILE_SAMPLES 16384
+ #define MAX_PROFILE_DEPTH 64
+ const char *profilePath = NULL;     // --profile=FILE, folded stacks for flame graphs
+ int profileHz = 997;                // --profile-hz=N, samples per second of CPU time
+ int profileAppend = 0;              // Add to the file the first tier wrote
+ void *(*profileFrames)[MAX_PROFILE_DEPTH];  // Return addresses of each sample
+ unsigned char *profileDepth;        // Frames captured per sample
+ int profileCount = 0;               // Samples taken, including dropped ones
+ 
+ // Warm state file format (see loadState). All offsets are relative to the
+ // start of the file so it can be mapped at any address and used in place.
+ #define STATE_MAGIC "SLST"
+ #define STATE_VERSION 1
+ 
+ typedef struct {
+     char magic[4];            // STATE_MAGIC
+     uint32_t version;         // STATE_VERSION
+     uint32_t fileSize;        // Total size, checked against the mapping
+     uint32_t symbolCount;     // Entries in the symbol array
+     uint32_t bucketCount;     // Size of the hash index (power of two)
+     uint32_t symbolsOffset;   // StateSymbol[symbolCount]
+     uint32_t bucketsOffset;   // uint32_t[bucketCount]: symbol index + 1, 0 if empty
+     uint32_t stringsOffset;   // NUL-terminated symbol names
+ } StateHeader;
+ 
+ typedef struct {
+     uint32_t nameOffset;      // Offset of the name inside the string table
+     int32_t address;          // Memory address assigned to the variable
+ } StateSymbol;
+ 
+ // Binary IR file format (see writeIR). Like the state file, every offset is
+ // relative to the start so a reader can map it and use it in place. 
+ #define IR_MAGIC "SLIR"
+ #define IR_VERSION 1
+ 
+ typedef struct {
+     char magic[4];            // IR_MAGIC
+     uint32_t version;         // IR_VERSION
+     uint32_t fileSize;        // Total size, checked against the mapping
+     uint32_t instrCount, labelCount, symbolCount, dataCount;
+     uint32_t instrOffset;     // IrInstr[instrCount]
+     uint32_t labelsOffset;    // IrLabel[labelCount], in program order
+     uint32_t symbolsOffset;   // IrSymbol[symbolCount]
+     uint32_t dataOffset;      // IrData[dataCount], the initial data image
+     uint32_t stringsOffset;   // NUL-terminated strings; offset 0 is ""
+ } IrHeader;
+ 
+ // Kind of an instruction operand 
+ enum { IR_NONE, IR_NUMBER, IR_LABEL, IR_TEXT };
+ 
+ typedef struct {
+     uint32_t opOffset;        // Mnemonic in the string table, 0 for a label definition
+     uint32_t kind;            // IR_* kind of the operand
+     int32_t operand;          // Number, label index, or string offset for IR_TEXT
+     uint32_t line;            // Source line
+ } IrInstr;
+ 
+ typedef struct {
+     uint32_t nameOffset;      // Label name in the string table
+     uint32_t instrIndex;      // Instruction that defines it
+ } IrLabel;
+ 
+ typedef struct {
+     uint32_t nameOffset;      // Variable name in the string table
+     int32_t address;          // Data memory address
+     uint32_t isVolatile;      // Bound with '@' to a device register
+ } IrSymbol;
+ 
+ typedef struct {
+     uint16_t address, value;  // One initialized data cell
+ } IrData;
+ 
+ const char *emitIrPath = NULL;      // --emit-ir=FILE
+ const char *loadIrPath = NULL;      // --load-ir=FILE, compile from IR instead of input.sl
+ 
+ const char *statePath = NULL;       // --state=FILE, NULL when disabled
+ const unsigned char *stateMap = NULL;  // Read-only mapping of the loaded state
+ size_t stateSize = 0;               // Size of the mapping
+ 
+ int optimizeLevel = 0;              // -O enables the peephole optimizer
+ int optimizeEnergy = 0;             // -Oenergy: costs are energy instead of cycles
+ FILE *remarksFile = NULL;           // --remarks=FILE, YAML optimization remarks
+ const char *remarksFilter = NULL;   // --remarks-filter=PASS[,PASS...]
+ int reportMissed = 0;               // Set while passes should record missed remarks
+ int optBisectLimit = -1;            // --opt-bisect-limit=N, -1 when disabled
+ _Thread_local int transformCount = 0;  // Transformations attempted so far
+ _Thread_local FILE *remarkBuffer = NULL;  // Remarks of a worker thread, merged in order later
+ int timeReport = 0;                 // --time-report
+ int partialEval = 0;                // --partial-eval[=STEPS], run input-independent code at compile time
+ int peBudget = 100000;              // Evaluation steps before partial evaluation gives up
+ int jobs = 1;                       // --jobs=N, threads for region-local passes
+ int tierBudget = 0;                 // --tiered[=MS], time the optimized tier may take
+ int tier = 0;                       // With --tiered: 1 in the unoptimized, 2 in the optimized tier
+ int tierPipe[2];                    // Closed by the first tier when its outputs are written
+ double optDeadline = 0;             // Clock time the optimizer must stop by, 0 for none
+ int deadlineHit = 0;                // The optimizer stopped early at optDeadline
+ 
+ // Set of data memory addresses, one bit each 
+ #define MAX_ADDRESS 256
+ typedef struct {
+     uint64_t bits[MAX_ADDRESS / 64];
+ } AddrSet;
+ 
+  // Address set helpers (one bit per data memory address)
+ void setAdd(AddrSet *set, int address) { set->bits[address / 64] |= 1ULL << (address % 64); }
+ void setRemove(AddrSet *set, int address) { set->bits[address / 64] &= ~(1ULL << (address % 64)); }
+ int setHas(const AddrSet *set, int address) { return (set->bits[address / 64] >> (address % 64)) & 1; }
+ 
+ AddrSet reservedCells;              // Device registers and cells of variables in the state file
+ 
+ // Register allocation for the 8080 backend 
+ const char regNames[] = "BCDE";
+ unsigned char interference[MAX_ADDRESS][MAX_ADDRESS];  // Cells live at the same time
+ int regOf[MAX_ADDRESS];                                // Register index of each cell, -1 in memory
+ 
+ // Initial data memory contents, written by the loader before the program runs 
+ int dataInit[MAX_ADDRESS];
+ AddrSet dataInitSet;
+ 
+ // Variables the program's result is read from (--live-out), both cells of a q8_8 
+ const char *liveOutList = NULL;     // --live-out=VAR[,VAR...], NULL when every variable is
+ AddrSet liveOutSet;
+ 
+ // Basic block in the control flow graph 
+ typedef struct {
+     int start, end;            // Instruction range [start, end)
+     int succStart, succCount;  // Successor block indices, stored in cfgEdges
+     int predStart, predCount;  // Predecessor block indices, stored in cfgEdges
+     AddrSet liveIn, liveOut;   // Addresses live on entry and exit
+ } Block;
+ 
+ // Analyses cached by the pass manager 
+ #define ANALYSIS_CFG 1
+ #define ANALYSIS_LIVENESS 2
+ 
+ // Per thread, since region-local passes build them for their own region (--jobs) 
+ _Thread_local Block blocks[MAX_CODE_LINES];       // Basic blocks, in buffer order
+ _Thread_local int blockCount = 0;
+ _Thread_local int blockOf[MAX_CODE_LINES];        // Block containing each assembly line
+ _Thread_local int cfgEdges[MAX_CODE_LINES * 4];   // Successor and predecessor lists
+ _Thread_local int edgeCount = 0;
+ _Thread_local int validAnalyses = 0;  // ANALYSIS_* bits that are up to date
+ _Thread_local const AddrSet *regionExitLive = NULL;  // Cells read after the region being optimized, NULL for the whole program
+ int analysisBuilds[2];              // Times the CFG and liveness were computed
+ int batchCount = 0;                 // Batches of region-local passes run over regions
+ double batchSeconds = 0;            // Wall time spent in them
+ 
+ // Possible values of an 8-bit quantity: an unsigned interval plus the bits
+ // known to be zero or one 
+ typedef struct {
+     int lo, hi;
+     int zeros, ones;
+ } Range;
+ 
+ // Abstract machine state tracked by the value range analysis 
+ typedef struct {
+     int reachable;
+     Range acc, flag;           // Accumulator, and the ALU result the Z flag reflects
+     int accBase, accDelta;     // acc == mem[accBase] + accDelta, when accBase >= 0
+     int flagBase, flagDelta;   // Same relation for the flag value
+     int carry;                 // Carry (borrow) flag: 0, 1, or -1 when unknown
+     Range mem[MAX_ADDRESS];
+ } RangeState;
+ 
+ // Symbolic value used by code motion: mem[base] + delta, or a constant 
+ #define SYM_UNKNOWN -1
+ #define SYM_CONST -2
+ #define SYM_NONE -3            // Not computed yet
+ typedef struct {
+     int base;                  // Cell address, or one of the SYM_* markers
+     int delta;                 // Offset, or the value for SYM_CONST
+ } SymVal;
+ 
+ // Optimization pass and the statistics kept for it 
+ typedef struct {
+     const char *name;          // Name used by remarks and --time-report
+     int (*run)(void);          // Returns nonzero if it changed the code
+     int preserves;             // ANALYSIS_* bits still valid after a change
+     int runs, changes;         // Times run, and how many of those changed code
+     int instrDelta;            // Net change in assembly lines
+     double seconds;            // Total time spent in the pass
+     int late;                  // Runs once after the others reach a fixed point
+     int local;                 // Only looks within regions; may run on them in parallel
+ } Pass;
  
 
 
+  // Increment a metrics counter
+ void metricAdd(MetricId id, long amount) {
+     metricValues[id] += amount;
+ }
+ 
+  // Monotonic clock in seconds, used for phase timing
+ double nowSeconds(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+ }
+ 
+ /*
+   Open the hardware performance counters
+   Each event is a separate counter for this process, user space only, so
+   one the CPU or a container does not offer leaves the others working.
+   Threads started later (--jobs) are counted as well.
+ */
+ void perfOpen(void) {
+     for (int e = 0; e < PERF_COUNT; e++) perfFds[e] = -1;
+ #ifdef __linux__
+     static const struct { uint32_t type; uint64_t config; } events[PERF_COUNT] = {
+         { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+         { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+         { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                               PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+         { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                               PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+         { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+     };
+     for (int e = 0; e < PERF_COUNT; e++) {
+         struct perf_event_attr attr;
+         memset(&attr, 0, sizeof(attr));
+         attr.size = sizeof(attr);
+         attr.type = events[e].type;
+         attr.config = events[e].config;
+         attr.exclude_kernel = 1;   // Allowed at the default perf_event_paranoid level
+         attr.exclude_hv = 1;
+         attr.inherit = 1;
+         attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+         perfFds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+         if (perfFds[e] < 0 && !perfError) perfError = strerror(errno);
+     }
+ #else
+     perfError = "not supported on this system";
+ #endif
+ }
+ 
+ /*
+   Read the current value of every open counter
+   Scaled up when the kernel had to multiplex counters; unavailable events
+   read as 0
+ */
+ void perfRead(uint64_t *values) {
+     for (int e = 0; e < PERF_COUNT; e++) {
+         uint64_t data[3];  // Value, time enabled, time running
+         values[e] = 0;
+         if (perfFds[e] < 0 || read(perfFds[e], data, sizeof(data)) != sizeof(data)) continue;
+         values[e] = data[2] ? (uint64_t)((double)data[0] * data[1] / data[2]) : 0;
+     }
+ }
+ 
+  // Start timing (and counting) a compiler phase
+ void beginPhase(void) {
+     if (perfCounters) perfRead(perfStart);
+     phaseStart = nowSeconds();
+ }
+ 
+  // Charge the time and events since beginPhase to a phase
+ void endPhase(Phase phase) {
+     phaseSeconds[phase] += nowSeconds() - phaseStart;
+     if (!perfCounters) return;
+     uint64_t now[PERF_COUNT];
+     perfRead(now);
+     for (int e = 0; e < PERF_COUNT; e++) phaseEvents[phase][e] += now[e] - perfStart[e];
+ }
+ 
+  // Split an assembly line into mnemonic and operand ("L0:" is a label)
+ void splitLine(Instr *in, const char *text) {
+     size_t len = strlen(text);
+     if (len > 0 && text[len - 1] == ':') {
+         in->op[0] = '\0';
+         snprintf(in->arg, sizeof(in->arg), "%.*s", (int)(len - 1), text);
+     } else {
+         const char *space = strchr(text, ' ');
+         snprintf(in->op, sizeof(in->op), "%.*s", space ? (int)(space - text) : (int)len, text);
+         snprintf(in->arg, sizeof(in->arg), "%s", space ? space + 1 : "");
+     }
+ }
+ 
   // Emit assembly code to output buffer
  void emit(const char *fmt, ...) {
+     char text[100];
      va_list args;
      va_start(args, fmt);
-     vsprintf(assembly[asmLine++], fmt, args);  // Format and store assembly line
+     vsnprintf(text, sizeof(text), fmt, args);  // Format the assembly line
      va_end(args);
+ 
+     if (asmLine >= MAX_CODE_LINES) {
+         fprintf(stderr, "Error: Too many lines of assembly\n");
+         exit(1);
+     }
+     Instr *in = &assembly[asmLine++];
+     splitLine(in, text);
+     in->line = tokenLine;
+     metricAdd(METRIC_INSTRUCTIONS, 1);
+ }
+ 
+  // Check whether an assembly line is a label
+ int isLabel(const Instr *in) {
+     return in->op[0] == '\0';
+ }
+ 
+  // Format an assembly line the way it appears in output.asm
+ void formatInstr(const Instr *in, char *buf, size_t size) {
+     if (isLabel(in)) snprintf(buf, size, "%s:", in->arg);
+     else if (in->arg[0]) snprintf(buf, size, "%s %s", in->op, in->arg);
+     else snprintf(buf, size, "%s", in->op);
  }
  
  /*
@@ -69,7 +565,9 @@
      const char* typeNames[] = {
          "TOKEN_INT", "TOKEN_IDENTIFIER", "TOKEN_NUMBER", "TOKEN_ASSIGN",
          "TOKEN_PLUS", "TOKEN_MINUS", "TOKEN_IF", "TOKEN_EQUAL",
-         "TOKEN_LPAREN", "TOKEN_RPAREN", "TOKEN_LBRACE", "TOKEN_RBRACE", "TOKEN_SEMICOLON",
+         "TOKEN_LPAREN", "TOKEN_RPAREN", "TOKEN_LBRACE", "TOKEN_RBRACE", "TOKEN_SEMICOLON", "TOKEN_AT",
+         "TOKEN_Q4_4", "TOKEN_Q8_8", "TOKEN_PLUS_SAT", "TOKEN_MINUS_SAT",
+         "TOKEN_SWITCH", "TOKEN_CASE", "TOKEN_DEFAULT", "TOKEN_COLON", "TOKEN_COMMA",
          "TOKEN_EOF", "TOKEN_UNKNOWN"
      };
      printf("Token: %s ('%s')\n", typeNames[token.type], token.text);
@@ -80,14 +578,19 @@
      // If we have a token pushed back, return that first
      if (hasToken) {
          hasToken = 0;
+         tokenLine = currentToken.line;
          return currentToken;
      }
  
      Token token;
      int c;
+     metricAdd(METRIC_TOKENS, 1);
      
      // Skip whitespace characters
-     while ((c = fgetc(file)) != EOF && isspace(c));
+     while ((c = fgetc(file)) != EOF && isspace(c)) {
+         if (c == '\n') sourceLine++;
+     }
+     token.line = tokenLine = sourceLine;
      
      // Handle end of file
      if (c == EOF) {
@@ -100,8 +603,8 @@
      if (isalpha(c)) {
          int len = 0;
          token.text[len++] = c;
-         // Read until non-alphanumeric character
-         while ((c = fgetc(file)) != EOF && isalnum(c)) {
+         // Read until non-alphanumeric character ('_' allowed after the first)
+         while ((c = fgetc(file)) != EOF && (isalnum(c) || c == '_')) {
              if (len < MAX_TOKEN_LEN - 1) token.text[len++] = c;
          }
          if (c != EOF) ungetc(c, file);  // Put back the extra character
@@ -110,6 +613,11 @@
          // Check if identifier is a keyword
          if (strcmp(token.text, "int") == 0) token.type = TOKEN_INT;
          else if (strcmp(token.text, "if") == 0) token.type = TOKEN_IF;
+         else if (strcmp(token.text, "q4_4") == 0) token.type = TOKEN_Q4_4;
+         else if (strcmp(token.text, "q8_8") == 0) token.type = TOKEN_Q8_8;
+         else if (strcmp(token.text, "switch") == 0) token.type = TOKEN_SWITCH;
+         else if (strcmp(token.text, "case") == 0) token.type = TOKEN_CASE;
+         else if (strcmp(token.text, "default") == 0) token.type = TOKEN_DEFAULT;
          else token.type = TOKEN_IDENTIFIER;
          return token;
      }
@@ -122,6 +630,12 @@
          while ((c = fgetc(file)) != EOF && isdigit(c)) {
              if (len < MAX_TOKEN_LEN - 1) token.text[len++] = c;
          }
+         // Fraction digits, for fixed-point constants
+         if (c == '.') {
+             do {
+                 if (len < MAX_TOKEN_LEN - 1) token.text[len++] = c;
+             } while ((c = fgetc(file)) != EOF && isdigit(c));
+         }
          if (c != EOF) ungetc(c, file);  // Put back the extra character
          token.text[len] = '\0';
          token.type = TOKEN_NUMBER;
@@ -144,13 +658,25 @@
                  strcpy(token.text, "=");
              }
              break;
-         case '+': token.type = TOKEN_PLUS; break;
-         case '-': token.type = TOKEN_MINUS; break;
+         case '+':
+         case '-':
+             // "+|" and "-|" are the saturating operators
+             if ((c = fgetc(file)) == '|') {
+                 token.type = token.text[0] == '+' ? TOKEN_PLUS_SAT : TOKEN_MINUS_SAT;
+                 strcat(token.text, "|");
+             } else {
+                 if (c != EOF) ungetc(c, file);
+                 token.type = token.text[0] == '+' ? TOKEN_PLUS : TOKEN_MINUS;
+             }
+             break;
          case '(': token.type = TOKEN_LPAREN; break;
          case ')': token.type = TOKEN_RPAREN; break;
          case '{': token.type = TOKEN_LBRACE; break;
          case '}': token.type = TOKEN_RBRACE; break;
          case ';': token.type = TOKEN_SEMICOLON; break;
+         case '@': token.type = TOKEN_AT; break;
+         case ':': token.type = TOKEN_COLON; break;
+         case ',': token.type = TOKEN_COMMA; break;
          default:
              token.type = TOKEN_UNKNOWN;
              break;
@@ -168,6 +694,114 @@
      hasToken = 1;
  }
  
+/*
+   Hash used by the state file's symbol index (32-bit FNV-1a)
+*/
+ uint32_t hashName(const char *name) {
+     uint32_t h = 2166136261u;
+     while (*name) {
+         h ^= (unsigned char)*name++;
+         h *= 16777619u;
+     }
+     return h;
+ }
+ 
+/*
+   Map a warm state file written by a previous run
+   The file is validated once and then used in place, nothing is rebuilt.
+   A missing file is not an error, the first run simply starts cold.
+   Recorded addresses are reserved rather than pushing currentAddress past
+   them, so new variables still fill the gaps below a high one.
+*/
+ void loadState(const char *path) {
+     int fd = open(path, O_RDONLY);
+     if (fd < 0) return;
+ 
+     struct stat st;
+     if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(StateHeader)) {
+         close(fd);
+         fprintf(stderr, "Warning: Ignoring truncated state file '%s'\n", path);
+         return;
+     }
+     void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+     close(fd);
+     if (map == MAP_FAILED) {
+         perror("Error mapping state file");
+         exit(1);
+     }
+ 
+     // Validate header and every offset before trusting the mapping
+     const StateHeader *hdr = map;
+     const unsigned char *base = map;
+     size_t size = st.st_size;
+     int ok = memcmp(hdr->magic, STATE_MAGIC, 4) == 0 && hdr->version == STATE_VERSION &&
+              hdr->fileSize == size && hdr->bucketCount > 0 &&
+              (hdr->bucketCount & (hdr->bucketCount - 1)) == 0 &&
+              hdr->symbolsOffset + (uint64_t)hdr->symbolCount * sizeof(StateSymbol) <= size &&
+              hdr->bucketsOffset + (uint64_t)hdr->bucketCount * sizeof(uint32_t) <= size &&
+              hdr->stringsOffset < size && base[size - 1] == '\0';
+     for (uint32_t i = 0; ok && i < hdr->symbolCount; i++) {
+         const StateSymbol *sym = (const StateSymbol *)(base + hdr->symbolsOffset) + i;
+         ok = hdr->stringsOffset + (uint64_t)sym->nameOffset < size &&
+              sym->address >= 0 && sym->address < MAX_ADDRESS;
+         if (ok) setAdd(&reservedCells, sym->address);
+     }
+     for (uint32_t i = 0; ok && i < hdr->bucketCount; i++) {
+         ok = ((const uint32_t *)(base + hdr->bucketsOffset))[i] <= hdr->symbolCount;
+     }
+     if (!ok) {
+         munmap(map, size);
+         memset(&reservedCells, 0, sizeof(reservedCells));
+         fprintf(stderr, "Warning: Ignoring incompatible state file '%s'\n", path);
+         return;
+     }
+     stateMap = base;
+     stateSize = size;
+ }
+ 
+/*
+   Look up a variable in the mapped state file
+   Returns its address, or -1 when it is not recorded there
+*/
+ int stateLookup(const char *name) {
+     if (!stateMap) return -1;
+     const StateHeader *hdr = (const StateHeader *)stateMap;
+     const StateSymbol *syms = (const StateSymbol *)(stateMap + hdr->symbolsOffset);
+     const uint32_t *buckets = (const uint32_t *)(stateMap + hdr->bucketsOffset);
+     const char *strings = (const char *)(stateMap + hdr->stringsOffset);
+ 
+     // Open addressing with linear probing
+     for (uint32_t b = hashName(name) & (hdr->bucketCount - 1), n = 0;
+          n < hdr->bucketCount && buckets[b] != 0;
+          b = (b + 1) & (hdr->bucketCount - 1), n++) {
+         const StateSymbol *sym = &syms[buckets[b] - 1];
+         if (strcmp(strings + sym->nameOffset, name) == 0) return sym->address;
+     }
+     return -1;
+ }
+ 
+  // Check whether a variable or temporary already uses a data address
+ int addressTaken(int address) {
+     for (int i = 0; i < varCount; i++) {
+         if (vars[i].address == address) return 1;
+     }
+     for (int i = 0; i < tempCount; i++) {
+         if (temps[i].address == address) return 1;
+     }
+     return 0;
+ }
+ 
+  // Next unused data address, stepping over variables bound with '@', device registers and state file cells
+ int freshAddress(void) {
+     while (currentAddress < MAX_ADDRESS &&
+            (addressTaken(currentAddress) || setHas(&reservedCells, currentAddress))) currentAddress++;
+     if (currentAddress >= MAX_ADDRESS) {
+         fprintf(stderr, "Error: Out of data memory\n");
+         exit(1);
+     }
+     return currentAddress++;
+ }
+ 
 /*
    Get memory address for a variable
    Adds to symbol table if not already present
@@ -183,137 +817,841 @@
          fprintf(stderr, "Error: Too many variables\n");
          exit(1);
      }
+     if (currentAddress >= MAX_ADDRESS) {
+         fprintf(stderr, "Error: Out of data memory\n");
+         exit(1);
+     }
  
-     // Add new variable to symbol table
+     // Add new variable to symbol table, reusing its address from a previous run if known
+     int address = stateLookup(name);
+     if (address >= 0 && addressTaken(address)) address = -1;
+     if (address >= 0) metricAdd(METRIC_STATE_HITS, 1);
      strcpy(vars[varCount].name, name);
-     vars[varCount].address = currentAddress++;
+     vars[varCount].address = (address >= 0) ? address : freshAddress();
+     vars[varCount].isVolatile = 0;
+     vars[varCount].type = TYPE_INT;
      return vars[varCount++].address;
  }
  
+  // Declared type of a variable; int for one not declared yet
+ VarType varType(const char *name) {
+     for (int i = 0; i < varCount; i++) {
+         if (strcmp(vars[i].name, name) == 0) return vars[i].type;
+     }
+     return TYPE_INT;
+ }
+ 
+  // Address of the high byte of a q8_8 variable, kept as the hidden variable "name.hi"
+ int hiAddress(const char *name) {
+     char hiName[MAX_TOKEN_LEN];
+     snprintf(hiName, sizeof(hiName), "%.96s.hi", name);
+     return getVarAddress(hiName);
+ }
+ 
  /*
-   Compile an expression (right-hand side of assignment)
-   Handles numbers, variables, and binary operations
-  */
- void compileExpression(FILE *file, const char *targetVar) {
-     Token token = getNextToken(file);
-     printToken(token); 
-     
-     if (token.type == TOKEN_NUMBER) {
-         // Handle literal numbers (e.g., a = 5)
-         emit("LDI %s", token.text);  // Load immediate value
-         
-         // Check for binary operation
-         Token op = getNextToken(file);
-         printToken(op);
-         
-         if (op.type == TOKEN_PLUS || op.type == TOKEN_MINUS) {
-             Token rhs = getNextToken(file);
-             printToken(rhs);
-             
-             if (rhs.type == TOKEN_NUMBER) {
-                 // Number op Number (e.g., 5 + 3)
-                 emit("%sI %s", (op.type == TOKEN_PLUS) ? "ADD" : "SUB", rhs.text);
-             } else if (rhs.type == TOKEN_IDENTIFIER) {
-                 // Number op Variable (e.g., 5 + x)
-                 emit("%s %d", (op.type == TOKEN_PLUS) ? "ADD" : "SUB", getVarAddress(rhs.text));
-             } else {
-                 fprintf(stderr, "Error: Expected number or identifier after operator\n");
-                 exit(1);
-             }
-         } else {
-             // No operator - just put it back
-             ungetToken(op);
+   Declare a variable of a given type ("q8_8 x;")
+   Declaring it again with the same type is allowed, as it always was for
+   int; a different type is an error
+ */
+ void declareVar(const char *name, VarType type) {
+     for (int i = 0; i < varCount; i++) {
+         if (strcmp(vars[i].name, name) == 0 && vars[i].type != type) {
+             fprintf(stderr, "Error: Variable '%s' is already declared as %s\n", name, varTypeNames[vars[i].type]);
+             exit(1);
          }
-         // Store result in target variable
-         emit("STA %d", getVarAddress(targetVar));
-     } 
-     else if (token.type == TOKEN_IDENTIFIER) {
-         // Handle variable expressions
-         char var[MAX_TOKEN_LEN];
-         strcpy(var, token.text);
-         
-         Token op = getNextToken(file);
-         printToken(op);
-         
-         if (op.type == TOKEN_PLUS || op.type == TOKEN_MINUS) {
-             // Binary operation (e.g., a + b)
-             emit("LDA %d", getVarAddress(var));  // Load first operand
-             
-             Token rhs = getNextToken(file);
-             printToken(rhs);
-             
-             if (rhs.type == TOKEN_NUMBER) {
-                 // Variable op Number (e.g., x + 5)
-                 emit("%sI %s", (op.type == TOKEN_PLUS) ? "ADD" : "SUB", rhs.text);
-             } else if (rhs.type == TOKEN_IDENTIFIER) {
-                 // Variable op Variable (e.g., x + y)
-                 emit("%s %d", (op.type == TOKEN_PLUS) ? "ADD" : "SUB", getVarAddress(rhs.text));
-             } else {
-                 fprintf(stderr, "Error: Expected number or identifier after operator\n");
-                 exit(1);
-             }
-             // Store result in target variable
-             emit("STA %d", getVarAddress(targetVar));
-         } else {
-             // Simple assignment (e.g., a = b)
-             emit("LDA %d", getVarAddress(var));
-             emit("STA %d", getVarAddress(targetVar));
-             ungetToken(op);
+     }
+     getVarAddress(name);
+     for (int i = 0; i < varCount; i++) {
+         if (strcmp(vars[i].name, name) == 0) vars[i].type = type;
+     }
+     if (type == TYPE_Q8_8) hiAddress(name);
+ }
+ 
+  // Check whether a data address belongs to a memory-mapped variable
+ int isVolatile(int address) {
+     for (int i = 0; i < varCount; i++) {
+         if (vars[i].address == address) return vars[i].isVolatile;
+     }
+     return 0;
+ }
+ 
+ /*
+   Declare a variable at a fixed address ("int x @ 240;")
+   Such a variable is a device register: every read and write is kept,
+   in order, by the optimizer. Several names may share one register.
+ */
+ void bindVarAddress(const char *name, int address, VarType type) {
+     for (int i = 0; i < varCount; i++) {
+         if (strcmp(vars[i].name, name) == 0) {
+             fprintf(stderr, "Error: Variable '%s' is already declared\n", name);
+             exit(1);
          }
-     } else {
-         fprintf(stderr, "Error: Expected identifier or number in expression\n");
+     }
+     if (varCount >= MAX_VARS) {
+         fprintf(stderr, "Error: Too many variables\n");
+         exit(1);
+     }
+     if (address < 0 || address >= MAX_ADDRESS || (addressTaken(address) && !isVolatile(address))) {
+         fprintf(stderr, "Error: Address %d is not free for '%s'\n", address, name);
          exit(1);
      }
+     strcpy(vars[varCount].name, name);
+     vars[varCount].address = address;
+     vars[varCount].type = type;
+     vars[varCount++].isVolatile = 1;
+ }
+  
+ /*
+   Cost of an instruction on the selected target
+   Used wherever code generation has to choose between equivalent sequences.
+   The objective is cycles, or energy in pJ with -Oenergy.
+ */
+ const OpCost *findCost(const char *op) {
+     for (const OpCost *c = target->costs; c->op; c++) {
+         if (strcmp(c->op, op) == 0) return c;
+     }
+     return NULL;
  }
+ int instrCost(const char *op) {
+     const OpCost *c = findCost(op);
+     if (!c) return optimizeEnergy ? target->stallEnergy : 1;
+     return optimizeEnergy ? c->energy : c->cycles;
+ }
+ 
+  // Cost of cycles lost to a taken branch or a skipped instruction
+ int stallCost(int cycles) {
+     return optimizeEnergy ? cycles * target->stallEnergy : cycles;
+ }
+ const char *costUnit(void) { return optimizeEnergy ? "pJ" : "cycles"; }
  
  /*
-   Compile a single statement
-   Handles variable declarations, assignments, and if statements
-  */
- void compileStatement(FILE *file) {
-     Token token = getNextToken(file);
-     printToken(token); // Debug output
-     
-     if (token.type == TOKEN_EOF) {
-         return;  // End of file
+   Allocate a scratch memory cell for an expression temporary
+   Reuses the lowest-addressed free slot so temporaries stay packed together
+   and only takes a fresh address when every existing slot is busy
+ */
+ int allocTemp(void) {
+     int best = -1;
+     for (int i = 0; i < tempCount; i++) {
+         if (!temps[i].busy && (best < 0 || temps[i].address < temps[best].address)) best = i;
      }
-     
-     if (token.type == TOKEN_INT) {
-         // Variable declaration 
-         token = getNextToken(file);
-         printToken(token);
-         
-         if (token.type != TOKEN_IDENTIFIER) {
-             fprintf(stderr, "Error: Expected identifier after 'int'\n");
+     if (best < 0) {
+         if (tempCount >= MAX_TEMPS) {
+             fprintf(stderr, "Error: Expression too complex\n");
              exit(1);
          }
-         // Add variable to symbol table
-         getVarAddress(token.text);
-         
-         token = getNextToken(file);
-         printToken(token);
-         
-         if (token.type != TOKEN_SEMICOLON) {
-             fprintf(stderr, "Error: Expected ';' after variable declaration\n");
+         int address = freshAddress();
+         best = tempCount++;
+         temps[best].address = address;
+     }
+     temps[best].busy = 1;
+     return temps[best].address;
+ }
+ 
+  // Release a scratch cell as soon as its value is dead
+ void freeTemp(int address) {
+     for (int i = 0; i < tempCount; i++) {
+         if (temps[i].address == address) temps[i].busy = 0;
+     }
+ }
+ 
+  // Add a node to the expression tree
+ int newNode(char kind, const char *text, int left, int right) {
+     if (nodeCount >= MAX_EXPR_NODES) {
+         fprintf(stderr, "Error: Expression too complex\n");
+         exit(1);
+     }
+     ExprNode *node = &nodes[nodeCount];
+     node->kind = kind;
+     strcpy(node->text, text);
+     node->left = left;
+     node->right = right;
+     return nodeCount++;
+ }
+ 
+ /*
+   Value of a constant in the representation of a type, scaled by 2^fraction
+   bits and rounded to the nearest step. A fraction in an int expression, or
+   a value past the largest of the type, is an error.
+ */
+ int fixedConstant(const char *text, VarType type) {
+     if (type == TYPE_INT) {
+         if (strchr(text, '.')) {
+             fprintf(stderr, "Error: Fractional constant '%s' in an int expression\n", text);
              exit(1);
          }
-     } 
-     else if (token.type == TOKEN_IDENTIFIER) {
-         // Assignment statement (e.g. x = 5)
-         char var[MAX_TOKEN_LEN];
-         strcpy(var, token.text);
-         
-         token = getNextToken(file);
-         printToken(token);
-         
-         if (token.type != TOKEN_ASSIGN) {
-             fprintf(stderr, "Error: Expected '=' after identifier\n");
+         return atoi(text);
+     }
+     int max = type == TYPE_Q8_8 ? 0xFFFF : 0xFF;
+     double scaled = strtod(text, NULL) * (1 << fractionBits[type]) + 0.5;
+     if (scaled >= max + 1) {
+         fprintf(stderr, "Error: Constant '%s' does not fit in %s\n", text, varTypeNames[type]);
+         exit(1);
+     }
+     return (int)scaled;
+ }
+ 
+ /*
+   Parse one operand: a number, a variable or a parenthesized expression
+   errorMessage is reported when the token cannot start an operand
+ */
+ int parseExpression(FILE *file);
+ int parseOperand(FILE *file, const char *errorMessage) {
+     Token token = getNextToken(file);
+     printToken(token);
+ 
+     if (token.type == TOKEN_NUMBER) {
+         // Fixed-point constants are stored scaled; int constants keep their text
+         if (exprType != TYPE_INT) snprintf(token.text, sizeof(token.text), "%d", fixedConstant(token.text, exprType));
+         else fixedConstant(token.text, TYPE_INT);
+         return newNode('n', token.text, -1, -1);
+     }
+     if (token.type == TOKEN_IDENTIFIER) {
+         if (varType(token.text) != exprType) {
+             fprintf(stderr, "Error: '%s' is %s in a %s expression\n", token.text,
+                     varTypeNames[varType(token.text)], varTypeNames[exprType]);
              exit(1);
          }
-         
-         // Compile the right-hand side expression
-         compileExpression(file, var);
-         
+         return newNode('v', token.text, -1, -1);
+     }
+     if (token.type == TOKEN_LPAREN) {
+         int node = parseExpression(file);
+         token = getNextToken(file);
+         printToken(token);
+         if (token.type != TOKEN_RPAREN) {
+             fprintf(stderr, "Error: Expected ')' in expression\n");
+             exit(1);
+         }
+         return node;
+     }
+     fprintf(stderr, "Error: %s\n", errorMessage);
+     exit(1);
+ }
+ 
+ /*
+   Parse an expression into the node pool
+   Operands joined by +, -, +| and -|, evaluated left to right
+ */
+ int parseExpression(FILE *file) {
+     const char kinds[] = { [TOKEN_PLUS] = '+', [TOKEN_MINUS] = '-', [TOKEN_PLUS_SAT] = 'p', [TOKEN_MINUS_SAT] = 'm' };
+     int node = parseOperand(file, "Expected identifier or number in expression");
+     while (1) {
+         Token op = getNextToken(file);
+         printToken(op);
+         if (op.type != TOKEN_PLUS && op.type != TOKEN_MINUS && op.type != TOKEN_PLUS_SAT && op.type != TOKEN_MINUS_SAT) {
+             ungetToken(op);  // Not part of the expression - put it back
+             return node;
+         }
+         int rhs = parseOperand(file, "Expected number or identifier after operator");
+         node = newNode(kinds[op.type], "", node, rhs);
+     }
+ }
+ 
+  // Check whether a node is a single number or variable
+ int isLeaf(int node) {
+     return nodes[node].kind == 'n' || nodes[node].kind == 'v';
+ }
+ 
+  // Operator helpers: additions, and the operators that clamp instead of wrapping
+ int isAddition(char kind) { return kind == '+' || kind == 'p'; }
+ int isSaturating(char kind) { return kind == 'p' || kind == 'm'; }
+ const char *aluOp(char kind, int immediate) {
+     if (isAddition(kind)) return immediate ? "ADDI" : "ADD";
+     return immediate ? "SUBI" : "SUB";
+ }
+ 
+  // Largest value of the expression type (q8_8 is 16 bits wide)
+ int exprMax(void) { return exprType == TYPE_Q8_8 ? 0xFFFF : 0xFF; }
+ 
+ /*
+   Evaluate a subtree that only involves numbers
+   Returns 1 and stores the result in value if it is constant: wrapped to
+   the width of the expression type, or clamped for +| and -|
+ */
+ int constantValue(int node, int *value) {
+     const ExprNode *n = &nodes[node];
+     if (n->kind == 'n') {
+         *value = atoi(n->text) & exprMax();
+         return 1;
+     }
+     int l, r;
+     if (n->kind == 'v' || !constantValue(n->left, &l) || !constantValue(n->right, &r)) return 0;
+     int result = isAddition(n->kind) ? l + r : l - r;
+     if (isSaturating(n->kind)) result = result < 0 ? 0 : result > exprMax() ? exprMax() : result;
+     *value = result & exprMax();
+     return 1;
+ }
+ 
+  // Estimated cost of evaluating a subtree into the accumulator
+ int expressionCost(int node) {
+     const ExprNode *n = &nodes[node];
+     if (n->kind == 'n') return instrCost("LDI");
+     if (n->kind == 'v') return instrCost("LDA");
+     const char *mem = aluOp(n->kind, 0);
+     int clamp = isSaturating(n->kind) ? instrCost("JNC") + instrCost("LDI") : 0;
+     if (isLeaf(n->right)) {
+         return expressionCost(n->left) + instrCost(aluOp(n->kind, nodes[n->right].kind == 'n')) + clamp;
+     }
+     return expressionCost(n->right) + instrCost("STA") + expressionCost(n->left) + instrCost(mem) + clamp;
+ }
+ 
+ /*
+   Clamp the result of a saturating operator
+   An unsigned overflow sets the carry and an underflow the borrow, so one
+   flag test replaces the result with the limit it passed
+ */
+ void genClamp(char kind) {
+     if (!isSaturating(kind)) return;
+     char label[20];
+     sprintf(label, "L%d", labelCount++);
+     emit("JNC %s", label);
+     emit("LDI %d", isAddition(kind) ? exprMax() : 0);
+     emit("%s:", label);
+ }
+ 
+ /*
+   Generate code that leaves the value of a subtree in the accumulator
+   A complex right operand is computed first and parked in a scratch cell,
+   unless it is a constant the cost model prefers to rematerialize as an
+   immediate operand
+ */
+ void genExpression(int node) {
+     const ExprNode *n = &nodes[node];
+     if (n->kind == 'n') {
+         emit("LDI %s", n->text);  // Load immediate value
+         return;
+     }
+     if (n->kind == 'v') {
+         emit("LDA %d", getVarAddress(n->text));
+         return;
+     }
+ 
+     const char *op = aluOp(n->kind, 0);
+     const ExprNode *rhs = &nodes[n->right];
+     if (isLeaf(n->right)) {
+         // Simple right operand (e.g. x + 5, x + y)
+         genExpression(n->left);
+         if (rhs->kind == 'n') emit("%sI %s", op, rhs->text);
+         else emit("%s %d", op, getVarAddress(rhs->text));
+         genClamp(n->kind);
+         return;
+     }
+ 
+     // Right operand is itself an expression
+     int value;
+     if (constantValue(n->right, &value) &&
+         instrCost("ADDI") < expressionCost(n->right) + instrCost("STA") + instrCost(op)) {
+         genExpression(n->left);
+         emit("%sI %d", op, value);  // Rematerialize instead of spilling
+         genClamp(n->kind);
+         return;
+     }
+     if (isAddition(n->kind) && isLeaf(n->left)) {
+         // Addition commutes, so fold the simple left operand in afterwards
+         genExpression(n->right);
+         const ExprNode *lhs = &nodes[n->left];
+         if (lhs->kind == 'n') emit("ADDI %s", lhs->text);
+         else emit("ADD %d", getVarAddress(lhs->text));
+         genClamp(n->kind);
+         return;
+     }
+     genExpression(n->right);
+     int temp = allocTemp();
+     emit("STA %d", temp);
+     genExpression(n->left);
+     emit("%s %d", op, temp);
+     genClamp(n->kind);
+     freeTemp(temp);
+ }
+ 
+  // Check whether a subtree reads a variable
+ int mentions(int node, const char *name) {
+     const ExprNode *n = &nodes[node];
+     if (n->kind == 'v') return strcmp(n->text, name) == 0;
+     return n->kind != 'n' && (mentions(n->left, name) || mentions(n->right, name));
+ }
+ 
+ // One operand of a 16-bit operation: a constant, or the cells of its two bytes
+ typedef struct {
+     int isConst;
+     int lo, hi;                // Byte values, or addresses
+ } WideOperand;
+ 
+  // Emit one byte of a 16-bit operand: op on its cell, or immediate on its constant byte
+ void emitWide(const char *op, const char *immediate, const WideOperand *w, int high) {
+     emit("%s %d", w->isConst ? immediate : op, high ? w->hi : w->lo);
+ }
+ 
+  // A variable or constant subtree as a 16-bit operand; returns 0 for anything else
+ int wideOperand(int node, WideOperand *w) {
+     int value;
+     if (nodes[node].kind == 'v') *w = (WideOperand){ 0, getVarAddress(nodes[node].text), hiAddress(nodes[node].text) };
+     else if (constantValue(node, &value)) *w = (WideOperand){ 1, value & 0xFF, value >> 8 };
+     else return 0;
+     return 1;
+ }
+ 
+ /*
+   Generate code that stores the q8_8 value of a subtree into cells lo and hi
+   The low bytes are combined with ADD/SUB and the high bytes with ADC/SBC,
+   which take the carry or borrow the low byte left. A saturating operator
+   tests the carry out of the high byte and clamps both. Constant subtrees
+   are folded; a complex right operand is computed into a pair of temporaries
+   and a complex left operand into the destination, so lo and hi must not be
+   read by the right operand when the left one is complex.
+ */
+ void genWide(int node, int lo, int hi) {
+     const ExprNode *n = &nodes[node];
+     WideOperand a, b;
+     if (wideOperand(node, &a)) {
+         emitWide("LDA", "LDI", &a, 0);
+         emit("STA %d", lo);
+         emitWide("LDA", "LDI", &a, 1);
+         emit("STA %d", hi);
+         return;
+     }
+ 
+     int temp = !wideOperand(n->right, &b);
+     if (temp) {
+         b = (WideOperand){ 0, allocTemp(), allocTemp() };
+         genWide(n->right, b.lo, b.hi);
+     }
+     if (!wideOperand(n->left, &a)) {
+         genWide(n->left, lo, hi);
+         a = (WideOperand){ 0, lo, hi };
+     }
+ 
+     int add = isAddition(n->kind);
+     emitWide("LDA", "LDI", &a, 0);
+     emitWide(aluOp(n->kind, 0), aluOp(n->kind, 1), &b, 0);
+     emit("STA %d", lo);
+     emitWide("LDA", "LDI", &a, 1);
+     emitWide(add ? "ADC" : "SBC", add ? "ADCI" : "SBCI", &b, 1);
+     if (isSaturating(n->kind)) {
+         char label[20];
+         sprintf(label, "L%d", labelCount++);
+         emit("JNC %s", label);
+         emit("LDI %d", add ? 255 : 0);
+         emit("STA %d", lo);
+         emit("%s:", label);
+     }
+     emit("STA %d", hi);
+     if (temp) {
+         freeTemp(b.lo);
+         freeTemp(b.hi);
+     }
+ }
+ 
+ /*
+   Compile an expression (right-hand side of assignment)
+   Handles numbers, variables, binary operations and parentheses
+  */
+ void compileExpression(FILE *file, const char *targetVar) {
+     nodeCount = 0;
+     exprType = varType(targetVar);
+     int root = parseExpression(file);
+     if (exprType == TYPE_Q8_8) {
+         // Two bytes: built in place, unless a complex left operand would overwrite the target early
+         WideOperand left;
+         if (isLeaf(root) || wideOperand(nodes[root].left, &left) || !mentions(root, targetVar)) {
+             genWide(root, getVarAddress(targetVar), hiAddress(targetVar));
+             return;
+         }
+         int lo = allocTemp(), hi = allocTemp();
+         genWide(root, lo, hi);
+         emit("LDA %d", lo);
+         emit("STA %d", getVarAddress(targetVar));
+         emit("LDA %d", hi);
+         emit("STA %d", hiAddress(targetVar));
+         freeTemp(lo);
+         freeTemp(hi);
+         return;
+     }
+     genExpression(root);
+     // Store result in target variable
+     emit("STA %d", getVarAddress(targetVar));
+ }
+ 
+ /*
+   switch lowering
+   The case bodies are compiled first, each after its own label, and the
+   dispatch is built once every case value is known, then moved in front
+   of them. There is no fall-through: a body ends at the next case.
+   Several dispatch sequences are generated, and each is costed with the
+   target cost table by running it for every selector value; the default
+   counts as one more outcome spread over the values no case names.
+     chain  LDA s / SUBI k1 / JZ C1 / SUBI k2-k1 / JZ C2 ... / JMP Cdefault
+     tree   binary search: SUBI k / JZ Ck / JC below / (above) / below: ...
+     table  LDA s / SUBI max+1 / ADDI entries / JNC Cdefault / JMPT Ltab
+   The tree is tried with leaf chains of at most 1, 2, 3 and 4 cases, and
+   the table only when at least a quarter of its entries name a case.
+ */
+ #define MAX_CASES 256
+ #define MAX_DISPATCH (4 * MAX_CASES + 16)
+ typedef struct {
+     int value;                 // Case value in the representation of the selector
+     int label;                 // Number of the label before its body
+ } Case;
+ 
+ typedef struct {
+     const char *kind;
+     Instr code[MAX_DISPATCH];
+     int count;
+     int labels;                // labelCount after generating it
+     long cost;                 // Weighted total over all selector values
+     double average;            // Expected cost of one dispatch
+     int bytes;
+ } Dispatch;
+ 
+ int isOp(const Instr *in, const char *op);
+ void writeRemark(const char *pass, const char *name, int line, const char *reason, const char *message);
+ void compileStatement(FILE *file);
+ 
+  // Append one line to a dispatch sequence
+ void dispatchLine(Dispatch *d, const char *fmt, ...) {
+     char text[100];
+     va_list args;
+     va_start(args, fmt);
+     vsnprintf(text, sizeof(text), fmt, args);
+     va_end(args);
+     splitLine(&d->code[d->count++], text);
+ }
+ 
+ void dispatchChain(Dispatch *d, const Case *cases, int n, int selector, int fallback) {
+     if (n > 0 || isVolatile(selector)) dispatchLine(d, "LDA %d", selector);  // A device register is read either way
+     for (int c = 0, at = 0; c < n; at = cases[c++].value) {
+         dispatchLine(d, "SUBI %d", (cases[c].value - at) & 0xFF);
+         dispatchLine(d, "JZ L%d", cases[c].label);
+     }
+     dispatchLine(d, "JMP L%d", fallback);
+ }
+ 
+ /*
+   Binary search over cases [lo, hi) with the accumulator holding the
+   selector minus 'at'. Every selector value and key that reaches a node
+   lies on the same side of 'at', so the borrow of "SUBI key - at" still
+   tells whether the selector is below the key.
+ */
+ void dispatchTree(Dispatch *d, const Case *cases, int lo, int hi, int at, int leaf, int fallback) {
+     if (hi - lo <= leaf) {
+         for (int c = lo; c < hi; at = cases[c++].value) {
+             dispatchLine(d, "SUBI %d", (cases[c].value - at) & 0xFF);
+             dispatchLine(d, "JZ L%d", cases[c].label);
+         }
+         dispatchLine(d, "JMP L%d", fallback);
+         return;
+     }
+     int mid = (lo + hi) / 2, below = labelCount++;
+     dispatchLine(d, "SUBI %d", (cases[mid].value - at) & 0xFF);
+     dispatchLine(d, "JZ L%d", cases[mid].label);
+     dispatchLine(d, "JC L%d", below);
+     dispatchTree(d, cases, mid + 1, hi, cases[mid].value, leaf, fallback);
+     dispatchLine(d, "L%d:", below);
+     dispatchTree(d, cases, lo, mid, cases[mid].value, leaf, fallback);
+ }
+ 
+ /*
+   Jump table over [min, max]. s - (max + 1) + entries carries exactly when
+   min <= s <= max, and leaves s - min as the index.
+ */
+ void dispatchTable(Dispatch *d, const Case *cases, int n, int selector, int fallback) {
+     int min = cases[0].value, max = cases[n - 1].value, entries = max - min + 1, table = labelCount++;
+     dispatchLine(d, "LDA %d", selector);
+     if (entries < 256) {
+         dispatchLine(d, "SUBI %d", (max + 1) & 0xFF);
+         dispatchLine(d, "ADDI %d", entries);
+         dispatchLine(d, "JNC L%d", fallback);
+     }
+     dispatchLine(d, "JMPT L%d", table);
+     dispatchLine(d, "L%d:", table);
+     for (int v = min, c = 0; v <= max; v++) {
+         dispatchLine(d, ".WORD L%d", c < n && cases[c].value == v ? cases[c++].label : fallback);
+     }
+ }
+ 
+  // Cost of running a dispatch sequence for one selector value, up to the jump that leaves it
+ int dispatchCost(const Dispatch *d, int value) {
+     int acc = 0, zero = 0, carry = 0, cost = 0;
+     for (int i = 0; i < d->count; i++) {
+         const Instr *in = &d->code[i];
+         if (isLabel(in)) continue;
+         cost += instrCost(in->op);
+         if (isOp(in, "LDA")) {
+             acc = value;
+         } else if (isOp(in, "ADDI") || isOp(in, "SUBI")) {
+             int result = isOp(in, "ADDI") ? acc + atoi(in->arg) : acc - atoi(in->arg);
+             acc = result & 0xFF;
+             zero = acc == 0;
+             carry = result < 0 || result > 255;
+         } else if (isOp(in, "JMP") || isOp(in, "JMPT") || (isOp(in, "JZ") && zero) ||
+                    (isOp(in, "JC") && carry) || (isOp(in, "JNC") && !carry)) {
+             cost += stallCost(target->branchPenalty);
+             int to = -1;
+             for (int j = 0; j < d->count && !isOp(in, "JMPT"); j++) {
+                 if (isLabel(&d->code[j]) && strcmp(d->code[j].arg, in->arg) == 0) to = j;
+             }
+             if (to < 0) return cost;  // Into a case body
+             i = to;
+         }
+     }
+     return cost;
+ }
+ 
+  // Weigh a dispatch sequence: every case once, and the default once over all other values
+ void dispatchWeigh(Dispatch *d, const Case *cases, int n) {
+     int isCase[256] = {0}, caseWeight = n < 256 ? 256 - n : 1;
+     long weight = 0;
+     for (int c = 0; c < n; c++) isCase[cases[c].value] = 1;
+     d->cost = 0;
+     for (int v = 0; v < 256; v++) {
+         d->cost += (long)dispatchCost(d, v) * (isCase[v] ? caseWeight : 1);
+         weight += isCase[v] ? caseWeight : 1;
+     }
+     d->average = (double)d->cost / weight;
+     d->bytes = 0;
+     for (int i = 0; i < d->count; i++) {
+         const OpCost *c = findCost(d->code[i].op);
+         d->bytes += isLabel(&d->code[i]) ? 0 : isOp(&d->code[i], ".WORD") ? 2 : c ? c->bytes : 2;
+     }
+ }
+ 
+  // Compile a switch statement, after the 'switch' keyword
+ void compileSwitch(FILE *file) {
+     int line = tokenLine;
+     Token token = getNextToken(file);
+     printToken(token);
+     if (token.type != TOKEN_LPAREN) {
+         fprintf(stderr, "Error: Expected '(' after 'switch'\n");
+         exit(1);
+     }
+     Token selector = getNextToken(file);
+     printToken(selector);
+     if (selector.type != TOKEN_IDENTIFIER) {
+         fprintf(stderr, "Error: Expected identifier in switch\n");
+         exit(1);
+     }
+     VarType type = varType(selector.text);
+     if (type == TYPE_Q8_8) {
+         fprintf(stderr, "Error: '%s' is q8_8; only one-byte variables can be switched on\n", selector.text);
+         exit(1);
+     }
+     token = getNextToken(file);
+     printToken(token);
+     if (token.type != TOKEN_RPAREN) {
+         fprintf(stderr, "Error: Expected ')' after switch value\n");
+         exit(1);
+     }
+     token = getNextToken(file);
+     printToken(token);
+     if (token.type != TOKEN_LBRACE) {
+         fprintf(stderr, "Error: Expected '{' after switch value\n");
+         exit(1);
+     }
+ 
+     // Bodies, each ending with a jump to the end
+     Case cases[MAX_CASES];
+     int n = 0, fallback = -1, end = labelCount++, start = asmLine, open = 0;
+     while ((token = getNextToken(file)).type != TOKEN_RBRACE) {
+         if (token.type == TOKEN_EOF) {
+             fprintf(stderr, "Error: Unexpected EOF while parsing switch block\n");
+             exit(1);
+         }
+         if (token.type != TOKEN_CASE && token.type != TOKEN_DEFAULT) {
+             if (!open) {
+                 fprintf(stderr, "Error: Expected 'case' or 'default' in switch\n");
+                 exit(1);
+             }
+             ungetToken(token);
+             compileStatement(file);
+             continue;
+         }
+         printToken(token);
+         if (open) emit("JMP L%d", end);
+         open = 1;
+         int label = labelCount++;
+         if (token.type == TOKEN_DEFAULT) {
+             if (fallback >= 0) {
+                 fprintf(stderr, "Error: More than one 'default' in switch\n");
+                 exit(1);
+             }
+             fallback = label;
+             token = getNextToken(file);
+             printToken(token);
+         } else {
+             do {
+                 token = getNextToken(file);
+                 printToken(token);
+                 if (token.type != TOKEN_NUMBER) {
+                     fprintf(stderr, "Error: Expected number after 'case'\n");
+                     exit(1);
+                 }
+                 int value = fixedConstant(token.text, type);
+                 if (value > 255) {
+                     fprintf(stderr, "Error: Case value '%s' does not fit in %s\n", token.text, varTypeNames[type]);
+                     exit(1);
+                 }
+                 for (int c = 0; c < n; c++) {
+                     if (cases[c].value == value) {
+                         fprintf(stderr, "Error: Duplicate case value '%s' in switch\n", token.text);
+                         exit(1);
+                     }
+                 }
+                 cases[n++] = (Case){ value, label };
+                 token = getNextToken(file);
+                 printToken(token);
+             } while (token.type == TOKEN_COMMA);
+         }
+         if (token.type != TOKEN_COLON) {
+             fprintf(stderr, "Error: Expected ':' after case\n");
+             exit(1);
+         }
+         emit("L%d:", label);
+     }
+     printToken(token);
+     if (fallback < 0) fallback = end;
+ 
+     // Cases in ascending order
+     for (int i = 1; i < n; i++) {
+         for (int j = i; j > 0 && cases[j].value < cases[j - 1].value; j--) {
+             Case t = cases[j]; cases[j] = cases[j - 1]; cases[j - 1] = t;
+         }
+     }
+ 
+     // Generate the candidates, each numbering its labels from the same point
+     static Dispatch candidates[6];
+     int base = labelCount, count = 0, address = getVarAddress(selector.text);
+     for (int kind = 0; kind < 6; kind++) {
+         Dispatch *d = &candidates[count];
+         int leaf = kind;
+         if (kind > 0 && kind < 5 && leaf >= n) continue;
+         if (kind == 5 && (n == 0 || 4 * n < cases[n - 1].value - cases[0].value + 1)) continue;
+         labelCount = base;
+         d->count = 0;
+         if (kind == 0) {
+             d->kind = "chain";
+             dispatchChain(d, cases, n, address, fallback);
+         } else if (kind < 5) {
+             d->kind = "compare tree";
+             dispatchLine(d, "LDA %d", address);
+             dispatchTree(d, cases, 0, n, 0, leaf, fallback);
+         } else {
+             d->kind = "jump table";
+             dispatchTable(d, cases, n, address, fallback);
+         }
+         d->labels = labelCount;
+         count++;
+     }
+     const Dispatch *best = NULL;
+     for (int c = 0; c < count; c++) {
+         dispatchWeigh(&candidates[c], cases, n);
+         if (!best || candidates[c].cost < best->cost || (candidates[c].cost == best->cost && candidates[c].bytes < best->bytes)) {
+             best = &candidates[c];
+         }
+     }
+     labelCount = best->labels;
+ 
+     // Report the choice against the best of each other kind
+     char message[200];
+     int length = snprintf(message, sizeof(message), "switch on %s with %d case(s): %s, %.1f %s per dispatch, %d bytes",
+                           selector.text, n, best->kind, best->average, costUnit(), best->bytes);
+     for (int c = 0; c < count; c++) {
+         int bestOfKind = 1;
+         for (int o = 0; o < count; o++) {
+             if (strcmp(candidates[o].kind, candidates[c].kind) == 0 &&
+                 (candidates[o].cost < candidates[c].cost || (candidates[o].cost == candidates[c].cost && o < c))) bestOfKind = 0;
+         }
+         if (bestOfKind && strcmp(candidates[c].kind, best->kind) != 0 && length < (int)sizeof(message)) {
+             length += snprintf(message + length, sizeof(message) - length, "; %s %.1f",
+                                candidates[c].kind, candidates[c].average);
+         }
+     }
+     writeRemark("switch", "SwitchLowering", line, NULL, message);
+ 
+     // Emit the dispatch after the bodies, then move it in front of them
+     static Instr moved[MAX_CODE_LINES];
+     int bodies = asmLine;
+     for (int i = 0; i < best->count; i++) {
+         char text[120];
+         formatInstr(&best->code[i], text, sizeof(text));
+         emit("%s", text);
+         assembly[asmLine - 1].line = line;
+     }
+     int size = asmLine - bodies;
+     memcpy(moved, &assembly[bodies], size * sizeof(Instr));
+     memmove(&assembly[start + size], &assembly[start], (bodies - start) * sizeof(Instr));
+     memcpy(&assembly[start], moved, size * sizeof(Instr));
+     emit("L%d:", end);
+ }
+ 
+ /*
+   Compile a single statement
+   Handles variable declarations, assignments, if and switch statements
+  */
+ void compileStatement(FILE *file) {
+     Token token = getNextToken(file);
+     printToken(token); // Debug output
+     
+     if (token.type == TOKEN_EOF) {
+         return;  // End of file
+     }
+     metricAdd(METRIC_STATEMENTS, 1);
+     
+     if (token.type == TOKEN_INT || token.type == TOKEN_Q4_4 || token.type == TOKEN_Q8_8) {
+         // Variable declaration 
+         VarType type = token.type == TOKEN_Q4_4 ? TYPE_Q4_4 : token.type == TOKEN_Q8_8 ? TYPE_Q8_8 : TYPE_INT;
+         token = getNextToken(file);
+         printToken(token);
+         
+         if (token.type != TOKEN_IDENTIFIER) {
+             fprintf(stderr, "Error: Expected identifier after '%s'\n", varTypeNames[type]);
+             exit(1);
+         }
+         char name[MAX_TOKEN_LEN];
+         strcpy(name, token.text);
+         
+         token = getNextToken(file);
+         printToken(token);
+         
+         if (token.type == TOKEN_AT) {
+             // Memory-mapped variable at a fixed address
+             token = getNextToken(file);
+             printToken(token);
+             if (token.type != TOKEN_NUMBER) {
+                 fprintf(stderr, "Error: Expected address after '@'\n");
+                 exit(1);
+             }
+             if (type == TYPE_Q8_8) {
+                 fprintf(stderr, "Error: '%s' is q8_8; only one-byte variables can be bound with '@'\n", name);
+                 exit(1);
+             }
+             bindVarAddress(name, atoi(token.text), type);
+             token = getNextToken(file);
+             printToken(token);
+         } else {
+             // Add variable to symbol table
+             declareVar(name, type);
+         }
+         
+         if (token.type != TOKEN_SEMICOLON) {
+             fprintf(stderr, "Error: Expected ';' after variable declaration\n");
+             exit(1);
+         }
+     } 
+     else if (token.type == TOKEN_IDENTIFIER) {
+         // Assignment statement (e.g. x = 5)
+         char var[MAX_TOKEN_LEN];
+         strcpy(var, token.text);
+         
+         token = getNextToken(file);
+         printToken(token);
+         
+         if (token.type != TOKEN_ASSIGN) {
+             fprintf(stderr, "Error: Expected '=' after identifier\n");
+             exit(1);
+         }
+         
+         // Compile the right-hand side expression
+         compileExpression(file, var);
+         
          token = getNextToken(file);
          printToken(token);
          
@@ -358,6 +1696,14 @@
              fprintf(stderr, "Error: Expected identifier or number in if condition\n");
              exit(1);
          }
+         // Both sides have the type of the variable on the left
+         VarType type = varType(lhs.text);
+         if (rhs.type == TOKEN_IDENTIFIER && varType(rhs.text) != type) {
+             fprintf(stderr, "Error: Comparing %s '%s' with %s '%s'\n", varTypeNames[type], lhs.text,
+                     varTypeNames[varType(rhs.text)], rhs.text);
+             exit(1);
+         }
+         int constant = rhs.type == TOKEN_NUMBER ? fixedConstant(rhs.text, type) : 0;
          
          token = getNextToken(file);
          printToken(token);
@@ -380,12 +1726,17 @@
          sprintf(labelTrue, "L%d", labelCount++);
          sprintf(labelEnd, "L%d", labelCount++);
          
-         // Generate comparison code
-         emit("LDA %d", getVarAddress(lhs.text));
-         if (rhs.type == TOKEN_NUMBER) {
-             emit("SUBI %s", rhs.text);  // Compare with immediate value
-         } else {
-             emit("SUB %d", getVarAddress(rhs.text));  // Compare with variable
+         // Generate comparison code; a q8_8 is only equal if its low bytes are
+         for (int high = 0; high <= (type == TYPE_Q8_8); high++) {
+             if (high) emit("JNZ %s", labelEnd);
+             emit("LDA %d", high ? hiAddress(lhs.text) : getVarAddress(lhs.text));
+             if (rhs.type == TOKEN_NUMBER && type == TYPE_INT) {
+                 emit("SUBI %s", rhs.text);  // Compare with immediate value
+             } else if (rhs.type == TOKEN_NUMBER) {
+                 emit("SUBI %d", high ? constant >> 8 : constant & 0xFF);
+             } else {
+                 emit("SUB %d", high ? hiAddress(rhs.text) : getVarAddress(rhs.text));  // Compare with variable
+             }
          }
          // Jump if equal (result is zero)
          emit("JZ %s", labelTrue);
@@ -408,6 +1759,10 @@
          // Label for end of if statement
          emit("%s:", labelEnd);
      } 
+     else if (token.type == TOKEN_SWITCH) {
+         // Switch statement ( e.g. switch (s) { case 0: ... case 1, 2: ... default: ... } )
+         compileSwitch(file);
+     }
      else if (token.type == TOKEN_SEMICOLON) {
          // Empty statement (just a semicolon)
      } 
@@ -430,38 +1785,3947 @@
      while (1) {
          Token token = getNextToken(file);
          if (token.type == TOKEN_EOF) break;
+         if (statementCount < MAX_CODE_LINES) statementLines[statementCount++] = token.line;
          ungetToken(token);
          compileStatement(file);
      }
  }
  
-
- int main() {
-     printf("SimpleLang Compiler\n");
-     
-     FILE *file = fopen("input.sl", "r");
-     if (!file) {
-         perror("Error opening file");
-         return 1;
+ /*
+   Optimizer
+   Peephole passes over the assembly buffer, enabled with -O and scheduled
+   by the pass manager below. Each change a pass makes, and each one it had
+   to give up on, is written to the remarks stream together with the source
+   line it came from.
+ */
+ 
+  // Name of the variable stored at a memory address (for remarks)
+ const char *varName(int address) {
+     for (int i = 0; i < varCount; i++) {
+         if (vars[i].address == address) return vars[i].name;
      }
+     for (int i = 0; i < tempCount; i++) {
+         if (temps[i].address == address) return "a temporary";
+     }
+     return "?";
+ }
  
-     // Perform compilation
-     compile(file);
-     fclose(file);
+  // Variables stay observable after the program ends; temporaries, and variables left out of --live-out, do not
+ int isVariable(int address) {
+     if (liveOutList) return setHas(&liveOutSet, address);
+     for (int i = 0; i < varCount; i++) {
+         if (vars[i].address == address) return 1;
+     }
+     return 0;
+ }
  
-     // Write assembly output
-     FILE *out = fopen("output.asm", "w");
-     if (!out) {
-         perror("Error creating output file");
-         return 1;
+  // Check whether a pass is selected by --remarks-filter
+ int passSelected(const char *pass) {
+     if (!remarksFilter) return 1;
+     size_t len = strlen(pass);
+     for (const char *p = remarksFilter; *p; ) {
+         const char *end = strchr(p, ',');
+         size_t n = end ? (size_t)(end - p) : strlen(p);
+         if (n == len && strncmp(p, pass, n) == 0) return 1;
+         p += n + (end != NULL);
      }
+     return 0;
+ }
  
-     // Output all generated assembly lines
-     for (int i = 0; i < asmLine; i++) {
-         fprintf(out, "%s\n", assembly[i]);
+ /*
+   Write one optimization remark in YAML
+   reason is NULL for an applied change
+ */
+ void writeRemark(const char *pass, const char *name, int line, const char *reason, const char *message) {
+     if (!remarksFile || !passSelected(pass)) return;
+     FILE *out = remarkBuffer ? remarkBuffer : remarksFile;
+     fprintf(out, "--- !%s\n", reason ? "Missed" : "Passed");
+     fprintf(out, "Pass:            %s\n", pass);
+     fprintf(out, "Name:            %s\n", name);
+     fprintf(out, "DebugLoc:        { File: '%s', Line: %d }\n", inputPath, line);
+     fprintf(out, "Message:         '%s'\n", message);
+     if (reason) fprintf(out, "Reason:          '%s'\n", reason);
+     fprintf(out, "...\n");
+ }
+ 
+ /*
+   Ask permission to apply one transformation
+   Every transformation is numbered; past --opt-bisect-limit the pass is told
+   to leave the code alone. Allowed changes are recorded as passed remarks.
+ */
+ int transform(const char *pass, const char *name, int line, const char *fmt, ...) {
+     if (reportMissed) return 0;  // The final round only looks for missed sites
+ 
+     char message[200];
+     va_list args;
+     va_start(args, fmt);
+     vsnprintf(message, sizeof(message), fmt, args);
+     va_end(args);
+ 
+     transformCount++;
+     if (optBisectLimit >= 0) {
+         int allowed = transformCount <= optBisectLimit;
+         fprintf(stderr, "BISECT: %srunning transformation (%d) %s on line %d: %s\n",
+                 allowed ? "" : "NOT ", transformCount, pass, line, message);
+         if (!allowed) return 0;
      }
-     fclose(out);
+     writeRemark(pass, name, line, NULL, message);
+     return 1;
+ }
  
-     printf("Compilation successful! Assembly written to output.asm\n");
+ /*
+   Record a transformation that a pass could not apply
+   Only kept during the final round so each blocked site is reported once
+ */
+ void missed(const char *pass, const char *name, int line, const char *reason, const char *fmt, ...) {
+     if (!reportMissed) return;
+ 
+     char message[200];
+     va_list args;
+     va_start(args, fmt);
+     vsnprintf(message, sizeof(message), fmt, args);
+     va_end(args);
+     writeRemark(pass, name, line, reason, message);
+ }
+ 
+  // Delete one line from the assembly buffer
+ void removeInstr(int index) {
+     memmove(&assembly[index], &assembly[index + 1], (asmLine - index - 1) * sizeof(Instr));
+     asmLine--;
+ }
+ 
+  // Instruction classification helpers
+ int isOp(const Instr *in, const char *op) { return strcmp(in->op, op) == 0; }
+ int isSkip(const Instr *in) { return isOp(in, "SKZ") || isOp(in, "SKNZ"); }
+ int isJump(const Instr *in) {
+     return isOp(in, "JMP") || isOp(in, "JZ") || isOp(in, "JNZ") || isOp(in, "JC") || isOp(in, "JNC");
+ }
+ // JMPT tab continues at the target of the .WORD entry tab + accumulator; the entries follow the label
+ int isTableJump(const Instr *in) { return isOp(in, "JMPT"); }
+ int isTableEntry(const Instr *in) { return isOp(in, ".WORD"); }
+ int refersToLabel(const Instr *in) { return isJump(in) || isTableJump(in) || isTableEntry(in); }
+ int usesCarry(const Instr *in) {
+     return isOp(in, "ADC") || isOp(in, "ADCI") || isOp(in, "SBC") || isOp(in, "SBCI") || isOp(in, "JC") || isOp(in, "JNC");
+ }
+ int isAlu(const Instr *in) {
+     return isOp(in, "ADD") || isOp(in, "ADDI") || isOp(in, "SUB") || isOp(in, "SUBI") || (usesCarry(in) && !isJump(in));
+ }
+ int readsAddress(const Instr *in, int address) {
+     return (isOp(in, "LDA") || isOp(in, "ADD") || isOp(in, "SUB") || isOp(in, "ADC") || isOp(in, "SBC")) &&
+            atoi(in->arg) == address;
+ }
+ int touchesVolatile(const Instr *in) {
+     return (isOp(in, "STA") || readsAddress(in, atoi(in->arg))) && isVolatile(atoi(in->arg));
+ }
+ 
+  // Find the line index of a label, or -1
+ int findLabel(const char *label) {
+     for (int i = 0; i < asmLine; i++) {
+         if (isLabel(&assembly[i]) && strcmp(assembly[i].arg, label) == 0) return i;
+     }
+     return -1;
+ }
+ 
+  // Count the jumps and table entries that target a label
+ int labelUses(const char *label) {
+     int uses = 0;
+     for (int i = 0; i < asmLine; i++) {
+         if (refersToLabel(&assembly[i]) && strcmp(assembly[i].arg, label) == 0) uses++;
+     }
+     return uses;
+ }
+ 
+  // Line of entry 'index' in the table after a label, or -1 past its end
+ int tableLine(const char *label, int index) {
+     int line = findLabel(label) + 1;
+     for (int k = 0; k < index && line < asmLine && isTableEntry(&assembly[line]); k++) line++;
+     return line < asmLine && isTableEntry(&assembly[line]) ? line : -1;
+ }
+ 
+ /*
+   Control flow graph analysis
+   Splits the buffer into basic blocks at labels and after jumps, then links
+   each block to its jump target and fall-through successor. A JMPT block
+   leads to its table, and the table block to every entry's target.
+ */
+ void buildCFG(void) {
+     int leader[MAX_CODE_LINES + 1] = {0};
+     blockCount = 0;
+     edgeCount = 0;
+     leader[0] = 1;
+     for (int i = 0; i < asmLine; i++) {
+         if (isLabel(&assembly[i])) leader[i] = 1;
+         if (isJump(&assembly[i]) || isTableJump(&assembly[i])) leader[i + 1] = 1;
+         if (isTableEntry(&assembly[i]) && (i + 1 == asmLine || !isTableEntry(&assembly[i + 1]))) leader[i + 1] = 1;
+         if (isSkip(&assembly[i]) && i + 2 <= asmLine) leader[i + 1] = leader[i + 2] = 1;
+     }
+     for (int i = 0; i < asmLine; i++) {
+         if (leader[i]) {
+             if (blockCount > 0) blocks[blockCount - 1].end = i;
+             blocks[blockCount].start = i;
+             blockCount++;
+         }
+         blockOf[i] = blockCount - 1;
+     }
+     if (blockCount > 0) blocks[blockCount - 1].end = asmLine;
+ 
+     // Successors: jump target first, then the fall-through block
+     for (int b = 0; b < blockCount; b++) {
+         const Instr *last = &assembly[blocks[b].end - 1];
+         blocks[b].succStart = edgeCount;
+         for (int i = isTableEntry(last) ? blocks[b].start : blocks[b].end - 1; i < blocks[b].end; i++) {
+             const Instr *in = &assembly[i];
+             if (!refersToLabel(in)) continue;
+             int labelIndex = findLabel(in->arg);
+             if (labelIndex < 0) {
+                 fprintf(stderr, "Error: Jump to undefined label '%s'\n", in->arg);
+                 exit(1);
+             }
+             int known = 0;
+             for (int e = blocks[b].succStart; e < edgeCount; e++) known |= cfgEdges[e] == blockOf[labelIndex];
+             if (!known) cfgEdges[edgeCount++] = blockOf[labelIndex];
+         }
+         if (isSkip(last) && b + 2 < blockCount) cfgEdges[edgeCount++] = b + 2;  // Past the skipped instruction
+         if (!isOp(last, "JMP") && !isTableJump(last) && !isTableEntry(last) && b + 1 < blockCount) cfgEdges[edgeCount++] = b + 1;
+         blocks[b].succCount = edgeCount - blocks[b].succStart;
+     }
+ 
+     // Predecessors, gathered from the successor lists
+     for (int b = 0; b < blockCount; b++) {
+         blocks[b].predStart = edgeCount;
+         for (int p = 0; p < blockCount; p++) {
+             for (int e = 0; e < blocks[p].succCount; e++) {
+                 if (cfgEdges[blocks[p].succStart + e] == b) cfgEdges[edgeCount++] = p;
+             }
+         }
+         blocks[b].predCount = edgeCount - blocks[b].predStart;
+     }
+     __atomic_fetch_add(&analysisBuilds[0], 1, __ATOMIC_RELAXED);
+ }
+ 
+ /*
+   Liveness analysis over data memory
+   An address is live when some path reads it before storing to it. Every
+   variable is live when the program ends, since memory is its only output;
+   with --live-out, only the listed ones. A region ends in the rest of the
+   program instead, which may read any cell it reads anywhere.
+ */
+ void buildLiveness(void) {
+     AddrSet exitLive = {{0}};
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (isVariable(x)) setAdd(&exitLive, x);
+     }
+     if (regionExitLive) exitLive = *regionExitLive;
+ 
+     for (int b = 0; b < blockCount; b++) {
+         memset(&blocks[b].liveIn, 0, sizeof(AddrSet));
+         memset(&blocks[b].liveOut, 0, sizeof(AddrSet));
+     }
+     int changed = 1;
+     while (changed) {
+         changed = 0;
+         for (int b = blockCount - 1; b >= 0; b--) {
+             Block *blk = &blocks[b];
+             AddrSet live = blk->succCount == 0 ? exitLive : (AddrSet){{0}};
+             for (int e = 0; e < blk->succCount; e++) {
+                 const AddrSet *in = &blocks[cfgEdges[blk->succStart + e]].liveIn;
+                 for (int w = 0; w < 4; w++) live.bits[w] |= in->bits[w];
+             }
+             blk->liveOut = live;
+             for (int i = blk->end - 1; i >= blk->start; i--) {
+                 const Instr *in = &assembly[i];
+                 if (isOp(in, "STA")) setRemove(&live, atoi(in->arg));
+                 else if (readsAddress(in, atoi(in->arg))) setAdd(&live, atoi(in->arg));
+             }
+             if (memcmp(&live, &blk->liveIn, sizeof(live)) != 0) {
+                 blk->liveIn = live;
+                 changed = 1;
+             }
+         }
+     }
+     __atomic_fetch_add(&analysisBuilds[1], 1, __ATOMIC_RELAXED);
+ }
+ 
+ /*
+   Get an analysis, rebuilding it only if a pass invalidated it
+   Liveness depends on the CFG, so requesting it brings the CFG up to date
+ */
+ void requireAnalysis(int analysis) {
+     if (!(validAnalyses & ANALYSIS_CFG)) {
+         buildCFG();
+         validAnalyses = ANALYSIS_CFG;
+     }
+     if ((analysis & ANALYSIS_LIVENESS) && !(validAnalyses & ANALYSIS_LIVENESS)) {
+         buildLiveness();
+         validAnalyses |= ANALYSIS_LIVENESS;
+     }
+ }
+ 
+ /*
+   Check whether the flags set by the instruction at index are never tested
+   Follows the only path out of it (through labels and JMPs) until another
+   ALU instruction overwrites the flags. ADC and SBC read the carry before
+   they overwrite it. On failure, reason describes the instruction that may
+   test them.
+ */
+ int flagsDeadAfter(int index, char *reason, size_t size) {
+     int steps = 0;
+     for (int i = index + 1; i < asmLine && steps < MAX_CODE_LINES; i++, steps++) {
+         const Instr *in = &assembly[i];
+         if (usesCarry(in)) {
+             snprintf(reason, size, "the carry is read by %s %s", in->op, in->arg);
+             return 0;
+         }
+         if (isAlu(in)) return 1;
+         if (isOp(in, "JZ") || isOp(in, "JNZ")) {
+             snprintf(reason, size, "flags are tested by %s %s", in->op, in->arg);
+             return 0;
+         }
+         if (isTableJump(in)) {
+             snprintf(reason, size, "flags reach the jump table %s", in->arg);
+             return 0;
+         }
+         if (isOp(in, "JMP")) i = findLabel(in->arg);
+     }
+     if (steps >= MAX_CODE_LINES) {
+         snprintf(reason, size, "flags reach a loop");
+         return 0;
+     }
+     return 1;
+ }
+ 
+ /*
+   Redundant load elimination
+   Tracks what the accumulator holds through straight-line code and drops
+   LDA/LDI that would reload the same value. When the accumulator holds the
+   cell plus a constant, the load becomes an ADDI/SUBI where that is cheaper
+   and nothing tests the flags. A label reached by a jump discards that
+   knowledge, which is reported as a missed remark.
+ */
+ int passRedundantLoad(void) {
+     int changed = 0;
+     int accAddr = -1;          // Address whose value the accumulator holds, or -1
+     int accDelta = 0;          // The accumulator is that value plus accDelta
+     int accConst = -1;         // Constant in the accumulator, or -1
+     int lostAddr = -1;         // accAddr on the fall-through path into the last label
+     const char *lostAt = NULL; // That label, until the accumulator is next written
+ 
+     for (int i = 0; i < asmLine; i++) {
+         Instr *in = &assembly[i];
+         if (isLabel(in)) {
+             if (labelUses(in->arg) > 0) {
+                 lostAddr = accDelta == 0 ? accAddr : -1;
+                 lostAt = in->arg;
+                 accAddr = accConst = -1;
+             }
+             continue;
+         }
+         if (isOp(in, "LDA")) {
+             int address = atoi(in->arg);
+             if (address == accAddr && accDelta == 0 && !isVolatile(address) &&
+                 transform("redundant-load", "RedundantLoad", in->line,
+                           "removed LDA %d: accumulator already holds %s", address, varName(address))) {
+                 removeInstr(i--);
+                 changed = 1;
+                 continue;
+             }
+             char reason[200];
+             const char *undo = accDelta < 128 ? "SUBI" : "ADDI";
+             int amount = accDelta < 128 ? accDelta : 256 - accDelta;
+             if (address == accAddr && accDelta != 0 && !isVolatile(address) && instrCost(undo) < instrCost("LDA") &&
+                 flagsDeadAfter(i, reason, sizeof(reason)) &&
+                 transform("redundant-load", "AccumulatorReuse", in->line, "LDA %d replaced by %s %d: accumulator holds %s %c %d",
+                           address, undo, amount, varName(address), accDelta < 128 ? '+' : '-', amount)) {
+                 strcpy(in->op, undo);
+                 snprintf(in->arg, sizeof(in->arg), "%d", amount);
+                 accDelta = 0;
+                 accConst = -1;
+                 changed = 1;
+                 lostAt = NULL;
+                 continue;
+             }
+             if (lostAt && address == lostAddr) {
+                 char reason[200];
+                 snprintf(reason, sizeof(reason), "accumulator invalidated by label %s", lostAt);
+                 missed("redundant-load", "RedundantLoad", in->line, reason,
+                        "LDA %d kept: %s is only in the accumulator on the fall-through path", address, varName(address));
+             }
+             accAddr = address;
+             accDelta = 0;
+             accConst = -1;
+         } else if (isOp(in, "LDI")) {
+             if (atoi(in->arg) == accConst &&
+                 transform("redundant-load", "RedundantLoad", in->line,
+                           "removed LDI %s: accumulator already holds that constant", in->arg)) {
+                 removeInstr(i--);
+                 changed = 1;
+                 continue;
+             }
+             accConst = atoi(in->arg);
+             accAddr = -1;
+         } else if (isOp(in, "STA")) {
+             accAddr = atoi(in->arg);
+             accDelta = 0;
+             continue;
+         } else if (isOp(in, "JMP")) {
+             accAddr = accConst = -1;
+         } else if ((isOp(in, "ADDI") || isOp(in, "SUBI")) && accAddr >= 0) {
+             accDelta = (accDelta + (isOp(in, "ADDI") ? atoi(in->arg) : -atoi(in->arg))) & 0xFF;
+             accConst = -1;
+         } else if (isAlu(in)) {
+             accAddr = accConst = -1;
+         } else {
+             continue;  // JZ/JNZ leave the accumulator alone on the fall-through path
+         }
+         lostAt = NULL;
+     }
+     return changed;
+ }
+ 
+ /*
+   Constant folding
+   LDI k followed by ADDI/SUBI m becomes a single LDI, as long as nothing
+   tests the flags the arithmetic would have set
+ */
+ int passConstantFold(void) {
+     int changed = 0;
+     for (int i = 0; i + 1 < asmLine; i++) {
+         Instr *in = &assembly[i], *next = &assembly[i + 1];
+         if (!isOp(in, "LDI") || !(isOp(next, "ADDI") || isOp(next, "SUBI"))) continue;
+ 
+         char reason[200];
+         int k = atoi(in->arg), m = atoi(next->arg);
+         if (!flagsDeadAfter(i + 1, reason, sizeof(reason))) {
+             missed("constant-fold", "ConstantFold", next->line, reason,
+                    "LDI %d / %s %d not folded", k, next->op, m);
+             continue;
+         }
+         int value = (isOp(next, "ADDI") ? k + m : k - m) & 0xFF;  // 8-bit wraparound
+         if (!transform("constant-fold", "ConstantFold", next->line,
+                        "folded LDI %d / %s %d into LDI %d", k, next->op, m, value)) continue;
+         snprintf(in->arg, sizeof(in->arg), "%d", value);
+         removeInstr(i + 1);
+         i--;
+         changed = 1;
+     }
+     return changed;
+ }
+ 
+ /*
+   Apply one instruction to the copies known to hold
+   copy[x] is the cell x was copied from ("LDA y / STA x"), or -1, and
+   accCell the cell whose value the accumulator holds. Storing to a cell
+   ends every copy from or into it. Copies are always of the original
+   source, so a chain "b = a; c = b;" makes c a copy of a.
+ */
+ void copyTransfer(int *copy, int *accCell, const Instr *in) {
+     int x = atoi(in->arg);
+     if (isOp(in, "LDA")) {
+         *accCell = isVolatile(x) ? -1 : copy[x] >= 0 ? copy[x] : x;
+     } else if (isOp(in, "STA")) {
+         for (int a = 0; a < MAX_ADDRESS; a++) {
+             if (copy[a] == x) copy[a] = -1;
+         }
+         copy[x] = *accCell != x && !isVolatile(x) ? *accCell : -1;
+         if (*accCell < 0 && !isVolatile(x)) *accCell = x;
+     } else if (!isLabel(in) && !isJump(in) && !isSkip(in)) {
+         *accCell = -1;  // LDI and arithmetic
+     }
+ }
+ 
+ /*
+   Copy propagation
+   Finds the copies that hold on every path (intersected at joins) and
+   makes reads of a copy read its source instead. The copy itself is then
+   left for dead-store elimination, which removes it once nothing reads it
+   and it is not needed when the program ends (see --live-out).
+ */
+ int passCopyPropagation(void) {
+     static int copyOut[MAX_CODE_LINES][MAX_ADDRESS];
+     int done[MAX_CODE_LINES] = {0};
+     int copy[MAX_ADDRESS], accCell, changed = 1, rewritten = 0;
+     requireAnalysis(ANALYSIS_CFG);
+ 
+     for (int final = 0; final < 2; final += !changed) {
+         changed = 0;
+         for (int b = 0; b < blockCount; b++) {
+             // Meet over the predecessors computed so far: optimistic until all are
+             int first = 1;
+             for (int x = 0; x < MAX_ADDRESS; x++) copy[x] = -1;
+             for (int e = 0; b > 0 && e < blocks[b].predCount; e++) {
+                 int p = cfgEdges[blocks[b].predStart + e];
+                 if (!done[p]) continue;
+                 for (int x = 0; x < MAX_ADDRESS; x++) {
+                     if (first) copy[x] = copyOut[p][x];
+                     else if (copy[x] != copyOut[p][x]) copy[x] = -1;
+                 }
+                 first = 0;
+             }
+             accCell = -1;
+             for (int i = blocks[b].start; i < blocks[b].end; i++) {
+                 Instr *in = &assembly[i];
+                 int x = atoi(in->arg);
+                 if (final && !isOp(in, "STA") && readsAddress(in, x) && copy[x] >= 0 &&
+                     transform("copy-prop", "CopyPropagation", in->line, "%s %d reads %s instead of its copy %s",
+                               in->op, x, varName(copy[x]), varName(x))) {
+                     snprintf(in->arg, sizeof(in->arg), "%d", copy[x]);
+                     rewritten = 1;
+                 }
+                 copyTransfer(copy, &accCell, in);
+             }
+             if (!done[b] || memcmp(copy, copyOut[b], sizeof(copy)) != 0) {
+                 memcpy(copyOut[b], copy, sizeof(copy));
+                 done[b] = 1;
+                 changed = 1;
+             }
+         }
+         if (final) break;
+     }
+     return rewritten;
+ }
+ 
+ /*
+   Check whether the accumulator value written at index is replaced by a
+   load before anything in the same block uses it
+ */
+ int accDeadAfter(int index, int end) {
+     for (int i = index + 1; i < end; i++) {
+         const Instr *in = &assembly[i];
+         if (isOp(in, "LDA") || isOp(in, "LDI")) return 1;
+         if (isOp(in, "STA") || isAlu(in)) return 0;
+     }
+     return regionExitLive && end == asmLine;  // Regions are cut where the accumulator is dead
+ }
+ 
+ /*
+   Dead store elimination
+   A STA is dead when no path reads the address before it is stored again
+   (liveness analysis). When a live store is overwritten in straight-line
+   order past a label or jump, the blocking path is reported as missed.
+   A load or arithmetic result that is replaced by another load before it
+   is used (and whose flags nothing tests) is dropped as well.
+ */
+ int passDeadStore(void) {
+     int dead[MAX_CODE_LINES];
+     int deadCount = 0;
+     requireAnalysis(ANALYSIS_LIVENESS);
+ 
+     for (int b = 0; b < blockCount; b++) {
+         AddrSet live = blocks[b].liveOut;
+         for (int i = blocks[b].end - 1; i >= blocks[b].start; i--) {
+             const Instr *in = &assembly[i];
+             char reason[200];
+             if ((isOp(in, "LDA") || isOp(in, "LDI") || (isAlu(in) && flagsDeadAfter(i, reason, sizeof(reason)))) &&
+                 !touchesVolatile(in) && accDeadAfter(i, blocks[b].end)) {
+                 if (transform("dead-store", "DeadValue", in->line,
+                               "removed %s %s: accumulator is reloaded before use", in->op, in->arg)) {
+                     dead[deadCount++] = i;
+                     continue;
+                 }
+             }
+             if (!isOp(in, "STA")) {
+                 if (readsAddress(in, atoi(in->arg))) setAdd(&live, atoi(in->arg));
+                 continue;
+             }
+ 
+             int address = atoi(in->arg);
+             if (!setHas(&live, address) && !isVolatile(address)) {
+                 if (transform("dead-store", "DeadStore", in->line,
+                               "removed STA %d: %s is stored again before it is read", address, varName(address))) {
+                     dead[deadCount++] = i;
+                 }
+                 continue;
+             }
+             setRemove(&live, address);
+             if (!reportMissed) continue;
+ 
+             // Live store: find out whether only a branch keeps it alive
+             const Instr *barrier = NULL;
+             for (int j = i + 1; j < asmLine; j++) {
+                 const Instr *next = &assembly[j];
+                 if (readsAddress(next, address)) break;
+                 if (!barrier && (isLabel(next) || refersToLabel(next))) barrier = next;
+                 if (!isOp(next, "STA") || atoi(next->arg) != address) continue;
+                 if (barrier) {
+                     char reason[200];
+                     snprintf(reason, sizeof(reason), "store may be read past %s %s",
+                              isLabel(barrier) ? "label" : barrier->op, barrier->arg);
+                     missed("dead-store", "DeadStore", in->line, reason,
+                            "STA %d kept: %s is overwritten on line %d", address, varName(address), next->line);
+                 }
+                 break;
+             }
+         }
+     }
+ 
+     // Indices were collected back to front within each block, so sort before deleting
+     for (int i = 0; i < deadCount; i++) {
+         for (int j = i + 1; j < deadCount; j++) {
+             if (dead[j] > dead[i]) { int t = dead[i]; dead[i] = dead[j]; dead[j] = t; }
+         }
+         removeInstr(dead[i]);
+     }
+     return deadCount > 0;
+ }
+ 
+  // Range helpers: the full 8-bit range, and a single known value
+ Range rangeTop(void) { return (Range){ 0, 255, 0, 0 }; }
+ Range rangeConst(int value) { return (Range){ value, value, ~value & 0xFF, value }; }
+ 
+ /*
+   Make the interval and the known bits agree with each other
+   Known bits bound the interval, and bits above the highest bit in which
+   lo and hi differ are known from the interval
+ */
+ void rangeNormalize(Range *r) {
+     if (r->lo < r->ones) r->lo = r->ones;
+     if (r->hi > (~r->zeros & 0xFF)) r->hi = ~r->zeros & 0xFF;
+     if (r->lo > r->hi) {
+         *r = rangeTop();  // Contradiction, only reachable on dead paths
+         return;
+     }
+     int diff = r->lo ^ r->hi, prefix = 0xFF;
+     while (diff) {
+         prefix = (prefix << 1) & 0xFF;
+         diff >>= 1;
+     }
+     r->ones |= r->lo & prefix;
+     r->zeros |= ~r->lo & prefix;
+ }
+ 
+ /*
+   Add or subtract two ranges with 8-bit wraparound
+   Intervals wrap as a whole or give up; known bits follow the carry chain
+ */
+ Range rangeAddSub(Range a, Range b, int subtract) {
+     Range r;
+     int lo = subtract ? a.lo - b.hi : a.lo + b.lo;
+     int hi = subtract ? a.hi - b.lo : a.hi + b.hi;
+     if (lo >= 0 && hi <= 255) { r.lo = lo; r.hi = hi; }
+     else if (lo >= 256 || hi < 0) { r.lo = lo & 0xFF; r.hi = hi & 0xFF; }
+     else { r.lo = 0; r.hi = 255; }
+ 
+     // a - b = a + ~b + 1
+     int bZeros = subtract ? b.ones : b.zeros, bOnes = subtract ? b.zeros : b.ones;
+     int sumMax = (~a.zeros & 0xFF) + (~bZeros & 0xFF) + subtract;
+     int sumMin = a.ones + bOnes + subtract;
+     int carryKnown = (~(sumMax ^ a.zeros ^ bZeros)) | (sumMin ^ a.ones ^ bOnes);
+     int known = (a.zeros | a.ones) & (bZeros | bOnes) & carryKnown & 0xFF;
+     r.zeros = ~sumMax & known & 0xFF;
+     r.ones = sumMin & known & 0xFF;
+     rangeNormalize(&r);
+     return r;
+ }
+ 
+  // Smallest range containing both
+ Range rangeJoin(Range a, Range b) {
+     Range r = { a.lo < b.lo ? a.lo : b.lo, a.hi > b.hi ? a.hi : b.hi, a.zeros & b.zeros, a.ones & b.ones };
+     rangeNormalize(&r);
+     return r;
+ }
+ 
+  // Remove one value from a range when it sits on an edge of the interval
+ void rangeExclude(Range *r, int value) {
+     if (r->lo == value && r->lo < r->hi) r->lo++;
+     else if (r->hi == value && r->lo < r->hi) r->hi--;
+     rangeNormalize(r);
+ }
+ 
+ /*
+   Merge the state flowing along one edge into a block's entry state
+   Returns 1 if the entry state changed
+ */
+ int rangeMerge(RangeState *into, const RangeState *from, int widen) {
+     if (!from->reachable) return 0;
+     if (!into->reachable) {
+         *into = *from;
+         return 1;
+     }
+     RangeState old = *into;
+     into->acc = rangeJoin(into->acc, from->acc);
+     into->flag = rangeJoin(into->flag, from->flag);
+     if (into->accBase != from->accBase || into->accDelta != from->accDelta) into->accBase = -1;
+     if (into->flagBase != from->flagBase || into->flagDelta != from->flagDelta) into->flagBase = -1;
+     if (into->carry != from->carry) into->carry = -1;
+     for (int a = 0; a < MAX_ADDRESS; a++) {
+         into->mem[a] = rangeJoin(into->mem[a], from->mem[a]);
+         if (widen && memcmp(&into->mem[a], &old.mem[a], sizeof(Range)) != 0) into->mem[a] = rangeTop();
+     }
+     return memcmp(&old, into, sizeof(old)) != 0;
+ }
+ 
+ /*
+   Apply one non-jump instruction to an abstract state
+   Besides ranges, remembers when the accumulator (and the value the Z flag
+   tests) is a known offset from a memory cell, so branches can refine it.
+   The carry is known when the full result is out of 8-bit range on every
+   value, or on none.
+ */
+ void rangeTransfer(RangeState *st, const Instr *in) {
+     if (isLabel(in) || isJump(in)) return;
+     int arg = atoi(in->arg);
+     if (isOp(in, "LDI")) {
+         st->acc = rangeConst(arg & 0xFF);
+         st->accBase = -1;
+     } else if (isOp(in, "LDA")) {
+         st->acc = st->mem[arg];
+         st->accBase = isVolatile(arg) ? -1 : arg;
+         st->accDelta = 0;
+     } else if (isOp(in, "STA")) {
+         st->mem[arg] = isVolatile(arg) ? rangeTop() : st->acc;  // A device register may change by itself
+         st->accBase = isVolatile(arg) ? -1 : arg;
+         st->accDelta = 0;
+         if (st->flagBase == arg) st->flagBase = -1;
+     } else if (isAlu(in)) {
+         int subtract = isOp(in, "SUB") || isOp(in, "SUBI") || isOp(in, "SBC") || isOp(in, "SBCI");
+         int immediate = isOp(in, "ADDI") || isOp(in, "SUBI") || isOp(in, "ADCI") || isOp(in, "SBCI");
+         Range a = st->acc, b = immediate ? rangeConst(arg & 0xFF) : st->mem[arg];
+         int carryMin = usesCarry(in) && st->carry == 1, carryMax = usesCarry(in) && st->carry != 0;
+         int lo = subtract ? a.lo - b.hi - carryMax : a.lo + b.lo + carryMin;
+         int hi = subtract ? a.hi - b.lo - carryMin : a.hi + b.hi + carryMax;
+         st->carry = lo > 255 || hi < 0 ? 1 : lo >= 0 && hi <= 255 ? 0 : -1;
+         st->acc = rangeAddSub(a, b, subtract);
+         if (carryMax) {
+             Range plus = rangeAddSub(st->acc, rangeConst(1), subtract);
+             st->acc = carryMin ? plus : rangeJoin(st->acc, plus);
+         }
+         if (immediate && !usesCarry(in) && st->accBase >= 0) st->accDelta = (st->accDelta + (subtract ? -arg : arg)) & 0xFF;
+         else st->accBase = -1;
+         st->flag = st->acc;
+         st->flagBase = st->accBase;
+         st->flagDelta = st->accDelta;
+     }
+ }
+ 
+ /*
+   Narrow a state for the edge where the Z flag is set (isZero) or clear
+   When the flag tests mem[base] + delta, the cell itself is narrowed too
+ */
+ void rangeRefine(RangeState *st, int isZero) {
+     int value = (256 - st->flagDelta) & 0xFF;  // mem[base] value that makes the result zero
+     if (isZero) {
+         st->flag = rangeConst(0);
+         if (st->flagBase >= 0) st->mem[st->flagBase] = rangeConst(value);
+     } else {
+         rangeExclude(&st->flag, 0);
+         if (st->flagBase >= 0) rangeExclude(&st->mem[st->flagBase], value);
+     }
+     if (st->accBase >= 0 && st->accBase == st->flagBase && st->accDelta == st->flagDelta) st->acc = st->flag;
+ }
+ 
+  // Check whether a range may contain zero
+ int rangeHasZero(const Range *r) { return r->lo == 0 && r->ones == 0; }
+ 
+  // Describe the value a conditional jump tests, for remarks
+ void describeFlag(const RangeState *st, char *buf, size_t size) {
+     if (st->flagBase < 0) snprintf(buf, size, "the result in [%d, %d]", st->flag.lo, st->flag.hi);
+     else if (st->flagDelta == 0) snprintf(buf, size, "%s in [%d, %d]", varName(st->flagBase), st->flag.lo, st->flag.hi);
+     else snprintf(buf, size, "%s - %d with %s in [%d, %d]", varName(st->flagBase), (256 - st->flagDelta) & 0xFF,
+                   varName(st->flagBase), st->mem[st->flagBase].lo, st->mem[st->flagBase].hi);
+ }
+ 
+ /*
+   Value range analysis
+   Abstract interpretation of the CFG with an interval and known bits for
+   the accumulator, the Z flag and every memory cell. It then folds
+   conditional jumps whose outcome is decided, deletes blocks that become
+   unreachable, and turns memory operands with a known value into
+   immediates when the target says that is cheaper.
+ */
+ int passValueRange(void) {
+     static RangeState entry[MAX_CODE_LINES];
+     int visits[MAX_CODE_LINES] = {0};
+     int worklist[MAX_CODE_LINES], pending[MAX_CODE_LINES] = {0};
+     int top = 0, changed = 0;
+     requireAnalysis(ANALYSIS_CFG);
+     if (blockCount == 0) return 0;
+ 
+     // Every cell starts unknown: memory is whatever the loader left there
+     for (int b = 0; b < blockCount; b++) entry[b].reachable = 0;
+     entry[0].reachable = 1;
+     entry[0].acc = entry[0].flag = rangeTop();
+     entry[0].accBase = entry[0].flagBase = -1;
+     entry[0].accDelta = entry[0].flagDelta = 0;
+     entry[0].carry = -1;
+     for (int a = 0; a < MAX_ADDRESS; a++) entry[0].mem[a] = rangeTop();
+     worklist[top++] = 0;
+     pending[0] = 1;
+ 
+     while (top > 0) {
+         int b = worklist[--top];
+         pending[b] = 0;
+         RangeState st = entry[b];
+         for (int i = blocks[b].start; i < blocks[b].end; i++) rangeTransfer(&st, &assembly[i]);
+ 
+         const Instr *last = &assembly[blocks[b].end - 1];
+         for (int e = 0; e < blocks[b].succCount; e++) {
+             int succ = cfgEdges[blocks[b].succStart + e];
+             RangeState edge = st;
+             // The first edge of a conditional jump is the taken one
+             if (isOp(last, "JZ") || isOp(last, "JNZ")) {
+                 int taken = (e == 0);
+                 rangeRefine(&edge, isOp(last, "JZ") ? taken : !taken);
+             }
+             if (isOp(last, "JC") || isOp(last, "JNC")) edge.carry = isOp(last, "JC") == (e == 0);
+             if (rangeMerge(&entry[succ], &edge, ++visits[succ] > 8) && !pending[succ]) {
+                 worklist[top++] = succ;
+                 pending[succ] = 1;
+             }
+         }
+     }
+ 
+     // Rewrite using the fixed point, collecting deletions for the end
+     int dead[MAX_CODE_LINES];
+     int deadCount = 0;
+     for (int b = 0; b < blockCount; b++) {
+         if (!entry[b].reachable) {
+             const Instr *first = &assembly[blocks[b].start];
+             if (transform("value-range", "UnreachableCode", first->line,
+                           "removed %d unreachable line(s) starting at %s%s", blocks[b].end - blocks[b].start,
+                           isLabel(first) ? "label " : first->op, isLabel(first) ? first->arg : "")) {
+                 for (int i = blocks[b].start; i < blocks[b].end; i++) dead[deadCount++] = i;
+             }
+             continue;
+         }
+ 
+         RangeState st = entry[b];
+         for (int i = blocks[b].start; i < blocks[b].end; i++) {
+             Instr *in = &assembly[i];
+             if (isTableJump(in) && st.acc.lo == st.acc.hi) {
+                 // The table is left without predecessors and goes in the next run
+                 int entry = tableLine(in->arg, st.acc.lo);
+                 if (entry >= 0 && transform("value-range", "FoldTableJump", in->line, "JMPT %s replaced by JMP %s: the index is always %d",
+                                          in->arg, assembly[entry].arg, st.acc.lo)) {
+                     strcpy(in->op, "JMP");
+                     strcpy(in->arg, assembly[entry].arg);
+                     changed = 1;
+                 }
+                 continue;
+             }
+             if (isOp(in, "JZ") || isOp(in, "JNZ") || isOp(in, "JC") || isOp(in, "JNC")) {
+                 char what[200];
+                 int taken, never;
+                 if (usesCarry(in)) {
+                     snprintf(what, sizeof(what), "the carry is %s", st.carry < 0 ? "not known" : st.carry ? "set" : "clear");
+                     taken = st.carry == isOp(in, "JC");
+                     never = st.carry == isOp(in, "JNC");
+                 } else {
+                     describeFlag(&st, what, sizeof(what));
+                     int canBeZero = rangeHasZero(&st.flag), alwaysZero = st.flag.hi == 0;
+                     taken = isOp(in, "JZ") ? alwaysZero : !canBeZero;
+                     never = isOp(in, "JZ") ? !canBeZero : alwaysZero;
+                 }
+                 if (taken && transform("value-range", "FoldBranch", in->line,
+                                        "%s %s always taken: %s", in->op, in->arg, what)) {
+                     strcpy(in->op, "JMP");
+                     changed = 1;
+                 } else if (never && transform("value-range", "FoldBranch", in->line,
+                                               "%s %s never taken: %s", in->op, in->arg, what)) {
+                     dead[deadCount++] = i;
+                 } else if (!taken && !never) {
+                     missed("value-range", "FoldBranch", in->line, "comparison is not decided by known ranges",
+                            "%s %s kept: %s", in->op, in->arg, what);
+                 }
+                 continue;
+             }
+ 
+             // Carry in that is always the same: plain arithmetic, with a set carry added to the immediate
+             int immediate = isOp(in, "ADCI") || isOp(in, "SBCI");
+             if (isAlu(in) && usesCarry(in) && (st.carry == 0 || (st.carry == 1 && immediate && atoi(in->arg) < 255))) {
+                 const char *plain = isOp(in, "ADC") ? "ADD" : isOp(in, "SBC") ? "SUB" : isOp(in, "ADCI") ? "ADDI" : "SUBI";
+                 if (transform("value-range", "KnownCarry", in->line, "%s %s replaced by %s %d: the carry is always %s",
+                               in->op, in->arg, plain, atoi(in->arg) + st.carry, st.carry ? "set" : "clear")) {
+                     int operand = atoi(in->arg) + st.carry;
+                     rangeTransfer(&st, in);
+                     strcpy(in->op, plain);
+                     snprintf(in->arg, sizeof(in->arg), "%d", operand);
+                     changed = 1;
+                     continue;
+                 }
+             }
+ 
+             // Memory operand with a single possible value
+             const char *imm = isOp(in, "LDA") ? "LDI" : isOp(in, "ADD") ? "ADDI" : isOp(in, "SUB") ? "SUBI" :
+                               isOp(in, "ADC") ? "ADCI" : isOp(in, "SBC") ? "SBCI" : NULL;
+             if (imm) {
+                 const Range *r = &st.mem[atoi(in->arg)];
+                 if (r->lo == r->hi && instrCost(imm) < instrCost(in->op) &&
+                     transform("value-range", "KnownValue", in->line, "%s %s replaced by %s %d: %s is always %d",
+                               in->op, in->arg, imm, r->lo, varName(atoi(in->arg)), r->lo)) {
+                     // The relation to the cell is still true, so keep it for this block
+                     int base = isOp(in, "LDA") ? atoi(in->arg) : -1;
+                     rangeTransfer(&st, in);
+                     strcpy(in->op, imm);
+                     snprintf(in->arg, sizeof(in->arg), "%d", r->lo);
+                     if (base >= 0) st.accBase = base;
+                     changed = 1;
+                     continue;
+                 }
+             }
+             rangeTransfer(&st, in);
+         }
+     }
+ 
+     for (int i = deadCount - 1; i >= 0; i--) removeInstr(dead[i]);
+ 
+     // Labels nothing jumps to any more
+     for (int i = 0; i < asmLine; i++) {
+         if (isLabel(&assembly[i]) && labelUses(assembly[i].arg) == 0 && deadCount > 0) removeInstr(i--);
+     }
+     return changed || deadCount > 0;
+ }
+ 
+  // Insert one line into the assembly buffer before index
+ void insertInstr(int index, const Instr *in) {
+     if (asmLine >= MAX_CODE_LINES) {
+         fprintf(stderr, "Error: Too many lines of assembly\n");
+         exit(1);
+     }
+     memmove(&assembly[index + 1], &assembly[index], (asmLine - index) * sizeof(Instr));
+     assembly[index] = *in;
+     asmLine++;
+ }
+ 
+ /*
+   Check whether the carry on entry to index can be read by ADC, SBC, JC or
+   JNC before an ALU instruction replaces it
+ */
+ int carryUsedFrom(int index, int depth) {
+     if (depth > 16) return 1;
+     for (int i = index; i < asmLine; i++) {
+         const Instr *in = &assembly[i];
+         if (usesCarry(in) || isTableJump(in)) return 1;  // Any table target may read it
+         if (isAlu(in)) return 0;
+         if (isOp(in, "JMP")) i = findLabel(in->arg);
+         else if (isJump(in) && carryUsedFrom(findLabel(in->arg), depth + 1)) return 1;
+     }
+     return 0;
+ }
+ 
+ /*
+   Check whether the accumulator value on entry to index can be read
+   Follows both sides of conditional jumps, up to a small depth
+ */
+ int accUsedFrom(int index, int depth) {
+     if (depth > 16) return 1;
+     for (int i = index; i < asmLine; i++) {
+         const Instr *in = &assembly[i];
+         if (isOp(in, "LDA") || isOp(in, "LDI")) return 0;
+         if (isOp(in, "STA") || isAlu(in) || isTableJump(in)) return 1;
+         if (isOp(in, "JMP")) i = findLabel(in->arg);
+         else if (isJump(in) && accUsedFrom(findLabel(in->arg), depth + 1)) return 1;
+     }
+     return 0;  // Nothing reads the accumulator after the program ends
+ }
+ 
+  // Apply one instruction to the symbolic accumulator and flag values
+ void symTransfer(SymVal *acc, SymVal *flag, const Instr *in) {
+     int arg = atoi(in->arg);
+     if (isOp(in, "LDI")) {
+         *acc = (SymVal){ SYM_CONST, arg & 0xFF };
+     } else if (isOp(in, "LDA")) {
+         *acc = (SymVal){ isVolatile(arg) ? SYM_UNKNOWN : arg, 0 };
+     } else if (isOp(in, "STA")) {
+         if (flag->base == arg) flag->base = SYM_UNKNOWN;
+         if (!isVolatile(arg)) *acc = (SymVal){ arg, 0 };
+     } else if (isOp(in, "ADDI") || isOp(in, "SUBI")) {
+         if (acc->base != SYM_UNKNOWN) acc->delta = (acc->delta + (isOp(in, "ADDI") ? arg : -arg)) & 0xFF;
+         *flag = *acc;
+     } else if (isAlu(in)) {
+         acc->base = flag->base = SYM_UNKNOWN;
+     }
+ }
+ 
+ int symEqual(SymVal a, SymVal b) {
+     return a.base == b.base && (a.base == SYM_UNKNOWN || a.delta == b.delta);
+ }
+ 
+ /*
+   Available values analysis
+   Computes what the accumulator and the Z flag hold at the end of every
+   block, as "cell + constant" or a constant, agreeing over all paths
+ */
+ void computeAvailable(SymVal *accOut, SymVal *flagOut) {
+     for (int b = 0; b < blockCount; b++) accOut[b].base = flagOut[b].base = SYM_NONE;
+     int changed = 1;
+     while (changed) {
+         changed = 0;
+         for (int b = 0; b < blockCount; b++) {
+             SymVal acc = { SYM_NONE, 0 }, flag = { SYM_NONE, 0 };
+             for (int e = 0; e < blocks[b].predCount; e++) {
+                 int p = cfgEdges[blocks[b].predStart + e];
+                 if (accOut[p].base == SYM_NONE) continue;  // Not computed yet: optimistic
+                 if (acc.base == SYM_NONE) acc = accOut[p];
+                 else if (!symEqual(acc, accOut[p])) acc.base = SYM_UNKNOWN;
+                 if (flag.base == SYM_NONE) flag = flagOut[p];
+                 else if (!symEqual(flag, flagOut[p])) flag.base = SYM_UNKNOWN;
+             }
+             if (b == 0 || acc.base == SYM_NONE) acc.base = flag.base = SYM_UNKNOWN;
+             for (int i = blocks[b].start; i < blocks[b].end; i++) symTransfer(&acc, &flag, &assembly[i]);
+             if (!symEqual(acc, accOut[b]) || !symEqual(flag, flagOut[b])) {
+                 accOut[b] = acc;
+                 flagOut[b] = flag;
+                 changed = 1;
+             }
+         }
+     }
+ }
+ 
+ /*
+   Partial redundancy elimination at join labels
+   A join block that starts by recomputing "LDA x" or "LDI k", optionally
+   followed by ADDI/SUBI, is checked against each predecessor. If every
+   predecessor already leaves the needed accumulator/flag value, the
+   computation is deleted. If only some do, and the others reach the join
+   through their only exit, it is moved into those others, so no path runs
+   more instructions and the paths that had the value run fewer.
+ */
+ int hoistJoinComputation(const SymVal *accOut, const SymVal *flagOut) {
+     for (int b = 1; b < blockCount; b++) {
+         if (blocks[b].predCount < 2) continue;
+         int first = blocks[b].start;
+         while (first < blocks[b].end && isLabel(&assembly[first])) first++;
+         if (first >= blocks[b].end || !(isOp(&assembly[first], "LDA") || isOp(&assembly[first], "LDI"))) continue;
+         if (touchesVolatile(&assembly[first])) continue;
+ 
+         // The computation: a load and any immediate arithmetic after it
+         int last = first;
+         while (last + 1 < blocks[b].end && (isOp(&assembly[last + 1], "ADDI") || isOp(&assembly[last + 1], "SUBI"))) last++;
+         SymVal acc = { SYM_UNKNOWN, 0 }, flag = { SYM_UNKNOWN, 0 };
+         for (int i = first; i <= last; i++) symTransfer(&acc, &flag, &assembly[i]);
+         char reason[200];
+         int needAcc = accUsedFrom(last + 1, 0);
+         int needFlags = last > first && !flagsDeadAfter(last, reason, sizeof(reason));
+         if (!needAcc && !needFlags) continue;  // Dead: left to dead-store
+         if (needFlags && carryUsedFrom(last + 1, 0)) {
+             // Available values only describe the Z flag
+             missed("code-motion", "PartialRedundancy", assembly[first].line, "the carry it sets is read later",
+                    "%s %s after label %s kept", assembly[first].op, assembly[first].arg, assembly[blocks[b].start].arg);
+             continue;
+         }
+ 
+         int have = 0, lacking = -1, critical = -1;
+         for (int e = 0; e < blocks[b].predCount; e++) {
+             int p = cfgEdges[blocks[b].predStart + e];
+             if ((!needAcc || symEqual(accOut[p], acc)) && (!needFlags || symEqual(flagOut[p], flag))) have++;
+             else if (blocks[p].succCount > 1 || isTableEntry(&assembly[blocks[p].end - 1])) critical = p;
+             else lacking = p;
+         }
+         if (have == 0) continue;
+         const Instr *head = &assembly[first];
+         if (critical >= 0) {
+             const Instr *from = &assembly[blocks[critical].end - 1];
+             snprintf(reason, sizeof(reason), "not available from %s %s on line %d, and that edge has no block to insert into",
+                      from->op, from->arg, from->line);
+             missed("code-motion", "PartialRedundancy", head->line, reason,
+                    "%s %s after label %s kept", head->op, head->arg, assembly[blocks[b].start].arg);
+             continue;
+         }
+ 
+         int count = last - first + 1;
+         Instr moved[MAX_CODE_LINES];
+         memcpy(moved, &assembly[first], count * sizeof(Instr));
+         char code[400] = "";
+         for (int i = 0; i < count; i++) {
+             char text[120];
+             formatInstr(&moved[i], text, sizeof(text));
+             snprintf(code + strlen(code), sizeof(code) - strlen(code), "%s%s", i ? " / " : "", text);
+         }
+         if (lacking < 0) {
+             if (!transform("code-motion", "FullRedundancy", head->line,
+                            "removed %s after label %s: every path into it already computes the value",
+                            code, assembly[blocks[b].start].arg)) continue;
+             for (int i = 0; i < count; i++) removeInstr(first);
+             return 1;
+         }
+         if (!transform("code-motion", "PartialRedundancy", head->line,
+                        "moved %s from label %s into the predecessor ending on line %d",
+                        code, assembly[blocks[b].start].arg, assembly[blocks[lacking].end - 1].line)) continue;
+ 
+         // Remove from the join first, then insert into each predecessor that lacks it, back to front
+         for (int i = 0; i < count; i++) removeInstr(first);
+         for (int e = blocks[b].predCount - 1; e >= 0; e--) {
+             int p = cfgEdges[blocks[b].predStart + e];
+             if ((!needAcc || symEqual(accOut[p], acc)) && (!needFlags || symEqual(flagOut[p], flag))) continue;
+             int at = blocks[p].end;
+             if (isOp(&assembly[at - 1], "JMP")) at--;
+             for (int i = count - 1; i >= 0; i--) insertInstr(at, &moved[i]);
+         }
+         return 1;
+     }
+     return 0;
+ }
+ 
+ /*
+   Partially dead store sinking
+   An assignment ("LDA/LDI ... STA x") in a block that ends with a
+   conditional jump, whose stored value is only read on one side of the
+   jump, is moved to the start of that side. The other path no longer
+   executes it at all.
+ */
+ int sinkPartiallyDeadStore(void) {
+     for (int b = 0; b < blockCount; b++) {
+         const Instr *jump = &assembly[blocks[b].end - 1];
+         if (!(isOp(jump, "JZ") || isOp(jump, "JNZ")) || blocks[b].succCount != 2) continue;
+ 
+         for (int g0 = blocks[b].start; g0 < blocks[b].end; g0++) {
+             if (!(isOp(&assembly[g0], "LDA") || isOp(&assembly[g0], "LDI"))) continue;
+             int g1 = g0 + 1;
+             while (g1 < blocks[b].end && isAlu(&assembly[g1]) && !usesCarry(&assembly[g1])) g1++;
+             if (g1 + 1 >= blocks[b].end || !isOp(&assembly[g1], "STA")) continue;
+             if (!(isOp(&assembly[g1 + 1], "LDA") || isOp(&assembly[g1 + 1], "LDI"))) continue;
+             int address = atoi(assembly[g1].arg), touches = 0;
+             for (int i = g0; i <= g1; i++) touches |= touchesVolatile(&assembly[i]);
+             if (touches) continue;  // Device accesses stay where they are
+ 
+             // The rest of the block must not read x, change the operands, or skip setting the flags
+             int ok = 0;
+             for (int i = g1 + 1; i < blocks[b].end - 1; i++) {
+                 const Instr *in = &assembly[i];
+                 if (readsAddress(in, address) || usesCarry(in)) { ok = 0; break; }
+                 if (isAlu(in)) ok = 1;
+                 if (isOp(in, "STA")) {
+                     for (int j = g0; j <= g1; j++) {
+                         if (atoi(in->arg) == atoi(assembly[j].arg) && !isOp(&assembly[j], "LDI") &&
+                             !(isOp(&assembly[j], "ADDI") || isOp(&assembly[j], "SUBI"))) ok = -1;
+                     }
+                     if (ok < 0) break;
+                 }
+             }
+             if (ok <= 0) continue;
+ 
+             int s0 = cfgEdges[blocks[b].succStart], s1 = cfgEdges[blocks[b].succStart + 1];
+             int live0 = setHas(&blocks[s0].liveIn, address), live1 = setHas(&blocks[s1].liveIn, address);
+             if (live0 == live1 || s0 == s1) continue;
+             int into = live0 ? s0 : s1;
+             char reason[200];
+             if (blocks[into].predCount != 1) {
+                 missed("code-motion", "SinkStore", assembly[g1].line, "the branch that reads it is also reached from elsewhere",
+                        "STA %d kept before %s %s: %s is only read on one side", address, jump->op, jump->arg, varName(address));
+                 continue;
+             }
+             if (accUsedFrom(blocks[into].start, 0) || !flagsDeadAfter(blocks[into].start - 1, reason, sizeof(reason))) continue;
+             if (!transform("code-motion", "SinkStore", assembly[g1].line,
+                            "moved the assignment to %s past %s %s into the only branch that reads it",
+                            varName(address), jump->op, jump->arg)) continue;
+ 
+             int count = g1 - g0 + 1;
+             Instr moved[MAX_CODE_LINES];
+             memcpy(moved, &assembly[g0], count * sizeof(Instr));
+             int at = blocks[into].start - count;
+             for (int i = 0; i < count; i++) removeInstr(g0);
+             while (at < asmLine && isLabel(&assembly[at])) at++;
+             for (int i = count - 1; i >= 0; i--) insertInstr(at, &moved[i]);
+             return 1;
+         }
+     }
+     return 0;
+ }
+ 
+ /*
+   Lazy code motion
+   Moves computations to where they make later ones redundant, and stores
+   to where their values are needed. One transformation per run; the pass
+   manager repeats the pass until nothing changes.
+ */
+ int passCodeMotion(void) {
+     static _Thread_local SymVal accOut[MAX_CODE_LINES], flagOut[MAX_CODE_LINES];
+     requireAnalysis(ANALYSIS_LIVENESS);
+     computeAvailable(accOut, flagOut);
+     if (hoistJoinComputation(accOut, flagOut)) return 1;
+     return sinkPartiallyDeadStore();
+ }
+ 
+ /*
+   Branch inversion
+   "JZ La / JMP Lb / La:" becomes "JNZ Lb", and La is dropped once nothing
+   else jumps to it; JC inverts to JNC the same way. A jump to a label that
+   directly follows it is removed.
+ */
+ int passBranchInversion(void) {
+     int changed = 0;
+     for (int i = 0; i < asmLine; i++) {
+         if (!isJump(&assembly[i])) continue;
+         int next = i + 1;
+         while (next < asmLine && isLabel(&assembly[next]) && strcmp(assembly[next].arg, assembly[i].arg) != 0) next++;
+         if (next >= asmLine || !isLabel(&assembly[next])) continue;
+         if (!transform("branch-inversion", "JumpToNext", assembly[i].line,
+                        "removed %s %s: the label follows directly", assembly[i].op, assembly[i].arg)) continue;
+         removeInstr(i);
+         if (labelUses(assembly[next - 1].arg) == 0) removeInstr(next - 1);
+         i--;
+         changed = 1;
+     }
+     for (int i = 0; i + 2 < asmLine; i++) {
+         Instr *jz = &assembly[i], *jmp = &assembly[i + 1], *label = &assembly[i + 2];
+         if (!(isOp(jz, "JZ") || isOp(jz, "JC")) || !isOp(jmp, "JMP") || !isLabel(label) ||
+             strcmp(jz->arg, label->arg) != 0) continue;
+ 
+         const char *inverse = isOp(jz, "JZ") ? "JNZ" : "JNC";
+         if (!transform("branch-inversion", "BranchInversion", jz->line,
+                        "%s %s / JMP %s inverted to %s %s", jz->op, jz->arg, jmp->arg, inverse, jmp->arg)) continue;
+         strcpy(jz->op, inverse);
+         strcpy(jz->arg, jmp->arg);
+         removeInstr(i + 1);
+         if (labelUses(assembly[i + 1].arg) == 0) removeInstr(i + 1);
+         changed = 1;
+     }
+     return changed;
+ }
+ 
+ /*
+   If-conversion
+   Turns "JNZ Lend / body / Lend:" (or JZ) around a single assignment into
+   straight-line code on targets with a conditional-skip instruction:
+     LDA v / ADDI k / STA v   becomes   LDA v / SKNZ / ADDI k / STA v
+     LDA w / STA v            becomes   LDA w / SKNZ / STA v
+   The flags left behind are the same on both paths as before. The target
+   cost model decides per site, assuming either outcome is equally likely.
+   Runs late, after the other passes have settled, since they do not model
+   skipped instructions.
+ */
+ int passIfConversion(void) {
+     int changed = 0;
+     for (int i = 0; i < asmLine; i++) {
+         Instr *jump = &assembly[i];
+         if (!(isOp(jump, "JZ") || isOp(jump, "JNZ"))) continue;
+ 
+         // Body: LDA/LDI, at most one ALU instruction, STA, then the end label
+         int store = i + 2;
+         if (store < asmLine && isAlu(&assembly[store])) store++;
+         if (store + 1 >= asmLine || !isOp(&assembly[store], "STA") || !isLabel(&assembly[store + 1]) ||
+             strcmp(assembly[store + 1].arg, jump->arg) != 0) continue;
+         Instr *load = &assembly[i + 1];
+         if (!(isOp(load, "LDA") || isOp(load, "LDI"))) continue;
+         int hasAlu = store == i + 3;
+ 
+         char reason[200];
+         if (!target->hasSkip) {
+             snprintf(reason, sizeof(reason), "target %s has no conditional-skip instruction", target->name);
+             missed("if-conversion", "IfConversion", jump->line, reason, "%s %s around one assignment kept", jump->op, jump->arg);
+             continue;
+         }
+         if (hasAlu && (!isOp(load, "LDA") || strcmp(load->arg, assembly[store].arg) != 0)) {
+             missed("if-conversion", "IfConversion", jump->line, "the assignment computes a new value from another variable",
+                    "%s %s around one assignment kept", jump->op, jump->arg);
+             continue;
+         }
+         if (touchesVolatile(load)) {
+             missed("if-conversion", "IfConversion", jump->line, "the load reads a memory-mapped variable",
+                    "%s %s around one assignment kept", jump->op, jump->arg);
+             continue;
+         }
+         if (labelUses(jump->arg) != 1) {
+             missed("if-conversion", "IfConversion", jump->line, "the end label has other jumps to it",
+                    "%s %s around one assignment kept", jump->op, jump->arg);
+             continue;
+         }
+         if (accUsedFrom(store + 2, 0)) {
+             missed("if-conversion", "IfConversion", jump->line, "the accumulator is read after the if",
+                    "%s %s around one assignment kept", jump->op, jump->arg);
+             continue;
+         }
+ 
+         // Expected cost for both outcomes together (a skipped instruction costs one cycle)
+         int body = instrCost(load->op) + (hasAlu ? instrCost(assembly[i + 2].op) : 0) + instrCost("STA");
+         int branchy = 2 * instrCost(jump->op) + stallCost(target->branchPenalty) + body;
+         const char *skip = isOp(jump, "JNZ") ? "SKNZ" : "SKZ";
+         int branchFree = hasAlu ? 2 * (instrCost(load->op) + instrCost(skip) + instrCost("STA")) + instrCost(assembly[i + 2].op) + stallCost(1)
+                                 : 2 * (instrCost(load->op) + instrCost(skip)) + instrCost("STA") + stallCost(1);
+         if (branchFree >= branchy) {
+             snprintf(reason, sizeof(reason), "not profitable on %s: %d.%d %s branch-free vs %d.%d with the jump",
+                      target->name, branchFree / 2, branchFree % 2 * 5, costUnit(), branchy / 2, branchy % 2 * 5);
+             missed("if-conversion", "IfConversion", jump->line, reason, "%s %s around one assignment kept", jump->op, jump->arg);
+             continue;
+         }
+         if (!transform("if-conversion", "IfConversion", jump->line,
+                        "%s %s replaced by %s: %d.%d expected %s instead of %d.%d", jump->op, jump->arg, skip,
+                        branchFree / 2, branchFree % 2 * 5, costUnit(), branchy / 2, branchy % 2 * 5)) continue;
+ 
+         // Move the skip in front of the instruction that must not run, drop the jump and label
+         Instr skipInstr = { "", "", jump->line };
+         strcpy(skipInstr.op, skip);
+         removeInstr(store + 1);
+         removeInstr(i);
+         insertInstr(i + 1, &skipInstr);  // Right after the load: before the ALU op or the store
+         changed = 1;
+     }
+     return changed;
+ }
+ 
+ // Passes in the order the pass manager runs them 
+ /*
+   Cost of setting up initial data memory, in bytes plus startup cycles
+   (startup energy with -Oenergy). Either inline LDI/STA pairs, or a ROM
+   table the loader copies at reset
+ */
+ int setupCost(const OpCost *c) {
+     return optimizeEnergy ? c->energy : c->bytes + c->cycles;
+ }
+ int initCost(const AddrSet *cells, int useTable) {
+     int count = 0, runs = 0;
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (!setHas(cells, x)) continue;
+         count++;
+         if (x == 0 || !setHas(cells, x - 1)) runs++;
+     }
+     if (count == 0) return 0;
+     if (!useTable) {
+         return count * (setupCost(findCost("LDI")) + setupCost(findCost("STA")));
+     }
+     return setupCost(findCost(".TABLE")) + runs * setupCost(findCost(".RUN")) + count * setupCost(findCost(".BYTE"));
+ }
+ 
+ /*
+   Data initialization
+   A constant stored to a variable in the entry block, before anything
+   reads or stores that variable, is its initial value: the store moves
+   into the ROM data table and the loader writes it at reset. Done for all
+   candidates together, when the table costs less than the LDI/STA pairs.
+ */
+ int passDataInit(void) {
+     if (!findCost(".TABLE")) return 0;
+     requireAnalysis(ANALYSIS_CFG);
+     if (blockCount == 0) return 0;
+ 
+     int candidate[MAX_ADDRESS], value[MAX_ADDRESS], count = 0;
+     int accKnown = 0, acc = 0;
+     AddrSet seen = dataInitSet, moved = {{0}};
+     for (int i = blocks[0].start; i < blocks[0].end; i++) {
+         const Instr *in = &assembly[i];
+         int x = atoi(in->arg);
+         if (isOp(in, "LDI")) {
+             accKnown = 1;
+             acc = x & 0xFF;
+         } else if (isOp(in, "STA")) {
+             if (accKnown && !setHas(&seen, x) && isVariable(x) && !isVolatile(x)) {
+                 candidate[count] = i;
+                 value[count++] = acc;
+                 setAdd(&moved, x);
+             }
+             setAdd(&seen, x);
+         } else {
+             if (readsAddress(in, x)) setAdd(&seen, x);
+             accKnown = 0;
+         }
+     }
+     if (count == 0) return 0;
+ 
+     AddrSet all = dataInitSet;
+     for (int w = 0; w < MAX_ADDRESS / 64; w++) all.bits[w] |= moved.bits[w];
+     int inlineCost = initCost(&moved, 0);
+     int tableCost = initCost(&all, 1) - initCost(&dataInitSet, 1);
+     if (tableCost >= inlineCost) {
+         for (int c = 0; c < count; c++) {
+             missed("data-init", "DataInit", assembly[candidate[c]].line, "inline stores are cheaper than the table",
+                    "initial value of %s kept as LDI/STA (stores cost %d, table %d)",
+                    varName(atoi(assembly[candidate[c]].arg)), inlineCost, tableCost);
+         }
+         return 0;
+     }
+ 
+     int changed = 0;
+     for (int c = 0; c < count; c++) {
+         int index = candidate[c] - changed, x = atoi(assembly[index].arg);
+         if (!transform("data-init", "DataInit", assembly[index].line,
+                        "initial value %d of %s moved to the ROM data table", value[c], varName(x))) continue;
+         setAdd(&dataInitSet, x);
+         dataInit[x] = value[c];
+         removeInstr(index);
+         changed++;
+     }
+ 
+     // Loads that only fed the moved stores are dead now
+     for (int i = 0; changed && i < asmLine && !isLabel(&assembly[i]) && !isJump(&assembly[i]); i++) {
+         if (isOp(&assembly[i], "LDI") && !accUsedFrom(i + 1, 0)) removeInstr(i--);
+     }
+     return changed > 0;
+ }
+ 
+ Pass passes[] = {
+     { .name = "branch-inversion", .run = passBranchInversion, .preserves = 0, .local = 1 },
+     { .name = "value-range",      .run = passValueRange,      .preserves = 0 },
+     { .name = "constant-fold",    .run = passConstantFold,    .preserves = 0, .local = 1 },
+     { .name = "redundant-load",   .run = passRedundantLoad,   .preserves = 0, .local = 1 },
+     { .name = "copy-prop",        .run = passCopyPropagation, .preserves = ANALYSIS_CFG },
+     { .name = "code-motion",      .run = passCodeMotion,      .preserves = 0, .local = 1 },
+     { .name = "dead-store",       .run = passDeadStore,       .preserves = 0, .local = 1 },
+     { .name = "if-conversion",    .run = passIfConversion,    .preserves = 0, .late = 1 },
+     { .name = "data-init",        .run = passDataInit,        .preserves = 0, .late = 1 },
+ };
+ const int passCount = sizeof(passes) / sizeof(passes[0]);
+ 
+ /*
+   Run one pass and keep its statistics
+   A pass that changed the code drops every analysis it does not preserve
+ */
+ int runPass(Pass *pass) {
+     int before = asmLine;
+     double start = nowSeconds();
+     int changed = pass->run();
+     pass->seconds += nowSeconds() - start;
+     pass->runs++;
+     if (changed) {
+         pass->changes++;
+         pass->instrDelta += asmLine - before;
+         validAnalyses &= pass->preserves;
+     }
+     return changed;
+ }
+ 
+ /*
+   Parallel region pipeline (--jobs=N)
+   The program is cut into regions where no jump, skip, accumulator value
+   or flag result crosses the cut. A batch of consecutive region-local
+   passes then runs on private copies of the regions in a pool of worker
+   threads, each region repeating the batch until it stops changing, and
+   the results are spliced back in program order. Global passes act as
+   barriers between batches.
+   A region is analyzed as if it were a whole program whose entry state is
+   unknown and whose exit reads the cells live at the cut (from liveness of
+   the whole program), so only facts about values flowing across a cut are
+   lost. Remarks and pass statistics are
+   collected per region and merged in region order, so the output depends
+   on neither scheduling nor the number of threads.
+ */
+ #define MIN_REGION 32          // Lines; smaller regions are not worth a hand-off
+ typedef struct {
+     int start, end;            // Lines of the program it was cut from
+     Instr *code;               // Private copy the pass works on
+     int length;
+     AddrSet exitLive;          // Cells the rest of the program may read
+     int first, last;           // Batch of passes to run: passes[first..last)
+     int rounds;                // Times to repeat the batch at most
+     Pass stats[sizeof(passes) / sizeof(passes[0])];  // Statistics shard per pass of the batch
+     int transforms;            // Transformations made in this region
+     char *remarks;             // Remarks written while it ran
+     size_t remarksSize;
+ } Region;
+ 
+ typedef struct {
+     pthread_mutex_t lock;
+     pthread_cond_t work, done;
+     Region *regions;
+     int count, next, finished;
+     int generation, stop;
+ } WorkPool;
+ 
+ WorkPool pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+ pthread_t workers[64];         // --jobs is at most 64
+ int workerCount = 0;
+ 
+  // Run the region's batch of passes on its private buffer
+ int pastDeadline(void);
+ void runRegion(Region *r) {
+     FILE *stream = remarksFile ? open_memstream(&r->remarks, &r->remarksSize) : NULL;
+     assembly = r->code;
+     asmLine = r->length;
+     remarkBuffer = stream;
+     transformCount = 0;
+     validAnalyses = 0;  // This thread's CFG may describe another region
+     regionExitLive = &r->exitLive;
+     for (int round = 0; round < r->rounds && !pastDeadline(); round++) {
+         int changed = 0;
+         for (int p = r->first; p < r->last; p++) changed |= runPass(&r->stats[p - r->first]);
+         if (!changed) break;
+     }
+     regionExitLive = NULL;
+     r->length = asmLine;
+     r->transforms = transformCount;
+     if (stream) fclose(stream);
+ }
+ 
+  // Worker thread: take regions from the current batch until none are left
+ void *workerMain(void *arg) {
+     int seen = 0;
+     (void)arg;
+     pthread_mutex_lock(&pool.lock);
+     while (1) {
+         while (!pool.stop && (pool.generation == seen || pool.next >= pool.count)) {
+             seen = pool.generation;
+             pthread_cond_wait(&pool.work, &pool.lock);
+         }
+         if (pool.stop) break;
+         Region *r = &pool.regions[pool.next++];
+         pthread_mutex_unlock(&pool.lock);
+         runRegion(r);
+         pthread_mutex_lock(&pool.lock);
+         if (++pool.finished == pool.count) pthread_cond_signal(&pool.done);
+     }
+     pthread_mutex_unlock(&pool.lock);
+     return NULL;
+ }
+ 
+ void startWorkers(void) {
+     for (workerCount = 0; workerCount < jobs - 1 && workerCount < 64; workerCount++) {
+         if (pthread_create(&workers[workerCount], NULL, workerMain, NULL) != 0) break;
+     }
+ }
+ 
+ void stopWorkers(void) {
+     pthread_mutex_lock(&pool.lock);
+     pool.stop = 1;
+     pthread_cond_broadcast(&pool.work);
+     pthread_mutex_unlock(&pool.lock);
+     for (int i = 0; i < workerCount; i++) pthread_join(workers[i], NULL);
+     workerCount = 0;
+ }
+ 
+ /*
+   Find the region boundaries of the program
+   A line can start a region when no jump or skip spans it and neither the
+   accumulator nor the flags are read before being set again
+ */
+ int cutRegions(int *starts) {
+     static int spanned[MAX_CODE_LINES + 1];
+     memset(spanned, 0, (asmLine + 1) * sizeof(int));
+     for (int i = 0; i < asmLine; i++) {
+         int to;
+         if (refersToLabel(&assembly[i])) to = findLabel(assembly[i].arg);
+         else if (isSkip(&assembly[i])) to = i + 2;
+         else continue;
+         int lo = i < to ? i : to, hi = i < to ? to : i;
+         for (int k = lo + 1; k <= hi && k <= asmLine; k++) spanned[k] = 1;
+     }
+ 
+     int count = 0;
+     starts[count++] = 0;
+     for (int i = 1; i < asmLine; i++) {
+         char reason[200];
+         if (i - starts[count - 1] < MIN_REGION || spanned[i]) continue;
+         if (accUsedFrom(i, 0) || !flagsDeadAfter(i - 1, reason, sizeof(reason))) continue;
+         starts[count++] = i;
+     }
+     starts[count] = asmLine;
+     return count;
+ }
+ 
+ /*
+   Cells live just before a line, from the whole-program liveness
+   The end of the buffer has the cells live when the program ends
+ */
+ AddrSet liveBefore(int line) {
+     AddrSet live = {{0}};
+     if (line >= asmLine) {
+         for (int x = 0; x < MAX_ADDRESS; x++) {
+             if (isVariable(x)) setAdd(&live, x);
+         }
+         return live;
+     }
+     const Block *blk = &blocks[blockOf[line]];
+     live = blk->liveOut;
+     for (int i = blk->end - 1; i >= line; i--) {
+         const Instr *in = &assembly[i];
+         if (isOp(in, "STA")) setRemove(&live, atoi(in->arg));
+         else if (readsAddress(in, atoi(in->arg))) setAdd(&live, atoi(in->arg));
+     }
+     return live;
+ }
+ 
+ /*
+   Run a batch of region-local passes over all regions at once
+   Returns nonzero if any region changed. Programs too small to split run
+   the batch as a whole, the same number of rounds.
+ */
+ int runBatchParallel(int first, int last, int rounds) {
+     static int starts[MAX_CODE_LINES + 1];
+     static Instr *buffers[MAX_CODE_LINES];  // Region copies, kept for the next batch
+     int count = cutRegions(starts);
+     if (count < 2) {
+         int any = 0;
+         for (int round = 0; round < rounds && !pastDeadline(); round++) {
+             int changed = 0;
+             for (int p = first; p < last; p++) changed |= runPass(&passes[p]);
+             any |= changed;
+             if (!changed) break;
+         }
+         return any;
+     }
+ 
+     double begin = nowSeconds();
+     Region *regions = calloc(count, sizeof(Region));
+     requireAnalysis(ANALYSIS_LIVENESS);
+     for (int r = 0; r < count; r++) {
+         regions[r].start = starts[r];
+         regions[r].end = starts[r + 1];
+         regions[r].length = starts[r + 1] - starts[r];
+         if (!buffers[r]) buffers[r] = malloc(MAX_CODE_LINES * sizeof(Instr));
+         regions[r].code = buffers[r];
+         if (!regions[r].code) {
+             fprintf(stderr, "Error: Out of memory\n");
+             exit(1);
+         }
+         memcpy(regions[r].code, &assembly[starts[r]], regions[r].length * sizeof(Instr));
+         regions[r].exitLive = liveBefore(regions[r].end);
+         regions[r].first = first;
+         regions[r].last = last;
+         regions[r].rounds = rounds;
+         for (int p = first; p < last; p++) {
+             regions[r].stats[p - first] = (Pass){ .name = passes[p].name, .run = passes[p].run, .preserves = passes[p].preserves };
+         }
+     }
+ 
+     // Hand the batch to the pool; this thread takes regions too
+     Instr *own = assembly;
+     int ownLength = asmLine, ownCount = transformCount;
+     pthread_mutex_lock(&pool.lock);
+     pool.regions = regions;
+     pool.count = count;
+     pool.next = pool.finished = 0;
+     pool.generation++;
+     pthread_cond_broadcast(&pool.work);
+     while (pool.next < pool.count) {
+         Region *r = &regions[pool.next++];
+         pthread_mutex_unlock(&pool.lock);
+         runRegion(r);
+         pthread_mutex_lock(&pool.lock);
+         pool.finished++;
+     }
+     while (pool.finished < pool.count) pthread_cond_wait(&pool.done, &pool.lock);
+     pthread_mutex_unlock(&pool.lock);
+     assembly = own;
+     asmLine = ownLength;
+     transformCount = ownCount;
+     remarkBuffer = NULL;
+ 
+     // Splice back and merge the shards in program order; a pass's time is summed over regions
+     static Instr merged[MAX_CODE_LINES];
+     int length = 0, changed = 0;
+     for (int r = 0; r < count; r++) {
+         if (length + regions[r].length > MAX_CODE_LINES) {
+             fprintf(stderr, "Error: Too many lines of assembly\n");
+             exit(1);
+         }
+         memcpy(&merged[length], regions[r].code, regions[r].length * sizeof(Instr));
+         length += regions[r].length;
+         for (int p = first; p < last; p++) {
+             const Pass *shard = &regions[r].stats[p - first];
+             changed |= shard->changes > 0;
+             passes[p].instrDelta += shard->instrDelta;
+             passes[p].seconds += shard->seconds;
+         }
+         transformCount += regions[r].transforms;
+         if (regions[r].remarks) {
+             fwrite(regions[r].remarks, 1, regions[r].remarksSize, remarksFile);
+             free(regions[r].remarks);
+         }
+     }
+     for (int p = first; p < last; p++) {
+         // Counted as the rounds of the busiest region
+         int runs = 0, changes = 0;
+         for (int r = 0; r < count; r++) {
+             if (regions[r].stats[p - first].runs > runs) runs = regions[r].stats[p - first].runs;
+             if (regions[r].stats[p - first].changes > changes) changes = regions[r].stats[p - first].changes;
+         }
+         passes[p].runs += runs;
+         passes[p].changes += changes;
+     }
+     free(regions);
+     memcpy(assembly, merged, length * sizeof(Instr));
+     asmLine = length;
+     batchSeconds += nowSeconds() - begin;
+     batchCount++;
+     validAnalyses = 0;  // This thread ran regions too, so its CFG is of one of them
+     return changed;
+ }
+ 
+ /*
+   Run the passes of one round, with rounds repeats of each local batch
+   Consecutive region-local passes form a batch, split over regions for
+   every --jobs (with one job this thread runs them all), so the code is
+   the same for any N. Only --opt-bisect-limit runs them over the whole
+   program, since its numbering needs one order.
+ */
+ int runRound(int rounds) {
+     int changed = 0;
+     for (int p = 0; p < passCount && !pastDeadline(); ) {
+         int end = p;
+         while (end < passCount && passes[end].local && !passes[end].late) end++;
+         if (end > p && optBisectLimit < 0) {
+             changed |= runBatchParallel(p, end, rounds);
+             p = end;
+         } else {
+             if (!passes[p].late) changed |= runPass(&passes[p]);
+             p++;
+         }
+     }
+     return changed;
+ }
+ 
+ /*
+   Pass manager
+   Runs the pass list to a fixed point, then a final round that changes
+   nothing records the missed remarks. Late passes run once afterwards,
+   followed by their own missed-remarks round. Global passes act as
+   barriers between the parallel batches of region-local ones. With a
+   deadline (--tiered) it stops between passes once the time is up.
+ */
+ int pastDeadline(void) {
+     if (optDeadline > 0 && nowSeconds() > optDeadline) __atomic_store_n(&deadlineHit, 1, __ATOMIC_RELAXED);
+     return __atomic_load_n(&deadlineHit, __ATOMIC_RELAXED);  // Region workers check it too
+ }
+ 
+ void optimize(void) {
+     validAnalyses = 0;
+     if (jobs > 1) startWorkers();
+     for (int round = 0; round < 100 && !pastDeadline(); round++) {
+         if (!runRound(100)) break;
+     }
+     if (__atomic_load_n(&deadlineHit, __ATOMIC_RELAXED)) {
+         if (workerCount) stopWorkers();
+         return;  // Every pass leaves correct code, so stopping between them is safe
+     }
+     reportMissed = 1;
+     runRound(1);
+     for (int p = 0; p < passCount; p++) {
+         if (!passes[p].late) continue;
+         reportMissed = 0;
+         runPass(&passes[p]);
+         reportMissed = 1;
+         runPass(&passes[p]);
+     }
+     reportMissed = 0;
+     if (workerCount) stopWorkers();
+ }
+ 
+ /*
+   Partial evaluation
+   Runs the program at compile time with every memory cell, the accumulator
+   and the flags either known or depending on input (cells read before the
+   program writes them). Known values fold away; work that depends on input
+   becomes the residual program. Evaluation stops at a branch on an input
+   value, or when the step budget runs out, and the rest of the program is
+   kept as it is. Known variables end up in the data image, or are stored
+   by the residual code when it touches the same cell.
+ */
+ static Instr residual[MAX_CODE_LINES];
+ static int residualCount;
+ 
+  // Append one instruction to the residual program
+ void residualEmit(const char *op, int arg, int line) {
+     if (residualCount >= MAX_CODE_LINES) {
+         fprintf(stderr, "Error: Too many lines of assembly\n");
+         exit(1);
+     }
+     Instr *in = &residual[residualCount++];
+     snprintf(in->op, sizeof(in->op), "%s", op);
+     snprintf(in->arg, sizeof(in->arg), "%d", arg);
+     in->line = line;
+ }
+ 
+ void partialEvaluate(void) {
+     int known[MAX_ADDRESS] = {0}, value[MAX_ADDRESS] = {0};
+     int touched[MAX_ADDRESS] = {0};    // The residual program reads or writes the cell
+     int accKnown = 0, accValue = 0, flagKnown = 0, flagZero = 0, flagCarry = 0;
+     int pc = 0, steps = 0, line = 0;
+     const char *stop = NULL;
+     residualCount = 0;
+ 
+     while (pc < asmLine) {
+         const Instr *in = &assembly[pc];
+         int arg = atoi(in->arg);
+         line = in->line;
+         if (steps >= peBudget) {
+             stop = "the step budget ran out";
+             break;
+         }
+         steps++;
+         if (isLabel(in)) {
+             pc++;
+         } else if (isJump(in) || isSkip(in)) {
+             if (!isOp(in, "JMP") && !flagKnown) {
+                 stop = "the condition depends on input";
+                 break;
+             }
+             int taken = isOp(in, "JMP") || (usesCarry(in) ? isOp(in, "JC") == flagCarry
+                                                           : (isOp(in, "JZ") || isOp(in, "SKZ")) == flagZero);
+             if (isSkip(in)) pc += taken ? 2 : 1;
+             else pc = taken ? findLabel(in->arg) : pc + 1;
+         } else if (isTableJump(in)) {
+             int entry = tableLine(in->arg, accValue);
+             if (!accKnown || entry < 0) {
+                 stop = "the table index depends on input";
+                 break;
+             }
+             pc = findLabel(assembly[entry].arg);
+         } else if (isOp(in, "LDI")) {
+             accKnown = 1;
+             accValue = arg & 0xFF;
+             pc++;
+         } else if (isOp(in, "LDA")) {
+             accKnown = known[arg];
+             accValue = value[arg];
+             if (!known[arg]) {
+                 residualEmit("LDA", arg, line);
+                 touched[arg] = 1;
+             }
+             pc++;
+         } else if (isOp(in, "STA") && isVolatile(arg)) {
+             // Device writes happen at run time, whatever the value
+             if (accKnown) residualEmit("LDI", accValue, line);
+             residualEmit("STA", arg, line);
+             touched[arg] = 1;
+             pc++;
+         } else if (isOp(in, "STA")) {
+             known[arg] = accKnown;
+             value[arg] = accValue;
+             if (!accKnown) {
+                 residualEmit("STA", arg, line);
+                 touched[arg] = 1;
+             }
+             pc++;
+         } else if (isAlu(in)) {
+             int immediate = isOp(in, "ADDI") || isOp(in, "SUBI") || isOp(in, "ADCI") || isOp(in, "SBCI");
+             int subtract = isOp(in, "SUB") || isOp(in, "SUBI") || isOp(in, "SBC") || isOp(in, "SBCI");
+             int operandKnown = immediate || known[arg];
+             int operand = immediate ? arg & 0xFF : value[arg];
+             int carry = usesCarry(in) && flagKnown && flagCarry;  // A known carry in
+             if (accKnown && operandKnown && (flagKnown || !usesCarry(in))) {
+                 int result = subtract ? accValue - operand - carry : accValue + operand + carry;
+                 accValue = result & 0xFF;
+                 flagKnown = 1;
+                 flagZero = accValue == 0;
+                 flagCarry = result < 0 || result > 255;
+             } else {
+                 // A carry known here was never computed at run time: fold it into the operand
+                 const char *op = in->op;
+                 if (usesCarry(in) && carry && (!operandKnown || operand == 255)) {
+                     stop = "the carry was computed at compile time";
+                     break;
+                 }
+                 if (usesCarry(in) && flagKnown) {
+                     op = subtract ? "SUB" : "ADD";
+                     operand += carry;
+                 }
+                 if (accKnown) residualEmit("LDI", accValue, line);
+                 if (operandKnown) {
+                     residualEmit(subtract ? (usesCarry(in) && !flagKnown ? "SBCI" : "SUBI")
+                                           : (usesCarry(in) && !flagKnown ? "ADCI" : "ADDI"), operand, line);
+                 } else {
+                     residualEmit(op, arg, line);
+                     touched[arg] = 1;
+                 }
+                 accKnown = flagKnown = 0;
+             }
+             pc++;
+         } else {
+             stop = "the instruction is not modelled";
+             break;
+         }
+     }
+ 
+     // The rest of the program must not jump back into what was evaluated
+     for (int i = pc; stop && i < asmLine; i++) {
+         if (refersToLabel(&assembly[i]) && findLabel(assembly[i].arg) < pc) {
+             writeRemark("partial-eval", "PartialEval", line, "a later jump returns into the evaluated part",
+                         "program left as it is");
+             return;
+         }
+     }
+ 
+     // Known cells: into the data image, or stored by code when the residual program touches them
+     int flush[MAX_ADDRESS], flushCount = 0;
+     memset(&dataInitSet, 0, sizeof(dataInitSet));
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         int needed = isVariable(x);
+         for (int i = pc; stop && !needed && i < asmLine; i++) needed = readsAddress(&assembly[i], x);
+         if (!known[x] || !needed) continue;
+         if (touched[x]) {
+             flush[flushCount++] = x;
+         } else {
+             setAdd(&dataInitSet, x);
+             dataInit[x] = value[x];
+         }
+     }
+ 
+     // Then rebuild the accumulator and Z flag the rest of the program expects
+     char reason[200];
+     int needFlag = stop && flagKnown && !flagsDeadAfter(pc - 1, reason, sizeof(reason));
+     int needAcc = stop && accUsedFrom(pc, 0), saved = -1, accLoaded = 0;
+     if (needAcc && !accKnown && (flushCount > 0 || needFlag)) {
+         // Temporaries the rest of the program still reads (one may span a clamp) are not free
+         for (int t = 0; t < tempCount; t++) {
+             for (int i = pc; i < asmLine && !temps[t].busy; i++) temps[t].busy = readsAddress(&assembly[i], temps[t].address);
+         }
+         saved = allocTemp();
+         for (int t = 0; t < tempCount; t++) temps[t].busy = 0;
+         residualEmit("STA", saved, line);
+     }
+     for (int f = 0; f < flushCount; f++) {
+         residualEmit("LDI", value[flush[f]], line);
+         residualEmit("STA", flush[f], line);
+     }
+     if (needFlag && flagCarry) {
+         // 255 + 1 leaves zero with the carry set, 255 + 2 leaves one
+         residualEmit("LDI", 255, line);
+         residualEmit("ADDI", flagZero ? 1 : 2, line);
+     } else if (needFlag && accKnown && flagZero == (accValue == 0)) {
+         residualEmit("LDI", accValue, line);
+         residualEmit("ADDI", 0, line);
+         accLoaded = 1;
+     } else if (needFlag) {
+         residualEmit("LDI", !flagZero, line);
+         residualEmit("ADDI", 0, line);
+     }
+     if (needAcc && accKnown && !accLoaded) residualEmit("LDI", accValue, line);
+     if (saved >= 0) residualEmit("LDA", saved, line);
+ 
+     int before = asmLine, evaluated = residualCount;
+     for (int i = pc; stop && i < asmLine; i++) residual[residualCount++] = assembly[i];
+     memcpy(assembly, residual, residualCount * sizeof(Instr));
+     asmLine = residualCount;
+     validAnalyses = 0;
+ 
+     char message[200];
+     int cells = 0;
+     for (int x = 0; x < MAX_ADDRESS; x++) cells += setHas(&dataInitSet, x);
+     snprintf(message, sizeof(message), "%d steps evaluated, %d instructions became %d plus %d data bytes",
+              steps, before, asmLine, cells);
+     writeRemark("partial-eval", "PartialEval", 0, NULL, message);
+     if (stop) {
+         snprintf(message, sizeof(message), "evaluation stopped here after emitting %d instructions", evaluated);
+         writeRemark("partial-eval", "PartialEval", line, stop, message);
+     }
+ }
+ 
+ /*
+   Print the --time-report table to stderr
+   Shows time per phase (and hardware events with --perf-counters), then
+   time, run count, changing runs and instruction delta per pass
+ */
+ void printTimeReport(void) {
+     fprintf(stderr, "===------------------------------------------------------------===\n");
+     fprintf(stderr, "                  SimpleLang compile time report\n");
+     fprintf(stderr, "===------------------------------------------------------------===\n");
+     fprintf(stderr, "  %-12s %10s\n", "Phase", "Time (s)");
+     for (int p = 0; p < PHASE_COUNT; p++) {
+         fprintf(stderr, "  %-12s %10.6f\n", phaseNames[p], phaseSeconds[p]);
+     }
+     if (perfCounters) {
+         fprintf(stderr, "\n  %-12s", "Phase");
+         for (int e = 0; e < PERF_COUNT; e++) fprintf(stderr, " %14s", perfNames[e]);
+         fprintf(stderr, " %6s\n", "IPC");
+         for (int p = 0; p < PHASE_COUNT; p++) {
+             fprintf(stderr, "  %-12s", phaseNames[p]);
+             for (int e = 0; e < PERF_COUNT; e++) {
+                 if (perfFds[e] < 0) fprintf(stderr, " %14s", "n/a");
+                 else fprintf(stderr, " %14llu", (unsigned long long)phaseEvents[p][e]);
+             }
+             uint64_t cycles = phaseEvents[p][PERF_CYCLES];
+             if (perfFds[PERF_CYCLES] < 0 || perfFds[PERF_INSTRUCTIONS] < 0 || cycles == 0) fprintf(stderr, " %6s\n", "n/a");
+             else fprintf(stderr, " %6.2f\n", (double)phaseEvents[p][PERF_INSTRUCTIONS] / cycles);
+         }
+         if (perfError) fprintf(stderr, "  Counters marked n/a are unavailable: %s\n", perfError);
+     }
+     if (optimizeLevel > 0) {
+         fprintf(stderr, "\n  %-18s %10s %6s %8s %12s\n", "Pass", "Time (s)", "Runs", "Changes", "Instr delta");
+         for (int p = 0; p < passCount; p++) {
+             fprintf(stderr, "  %-18s %10.6f %6d %8d %+12d\n", passes[p].name, passes[p].seconds,
+                     passes[p].runs, passes[p].changes, passes[p].instrDelta);
+         }
+         fprintf(stderr, "\n  Analyses built: cfg %d, liveness %d\n", analysisBuilds[0], analysisBuilds[1]);
+         fprintf(stderr, "  Transformations: %d\n", transformCount);
+         if (batchCount > 0) {
+             fprintf(stderr, "  Region batches: %d on %d thread(s), %.6f s wall (pass times above add up all threads)\n",
+                     batchCount, jobs, batchSeconds);
+         }
+     }
+ }
+ 
+ /*
+   Sampling profiler
+   With --profile the kernel sends SIGPROF after every 1/profileHz seconds of
+   CPU time used by any thread of the compiler, and the handler only copies
+   the return addresses on the interrupted stack. Frames are named after the
+   compile, from the symbol table of the running executable, so a normal
+   build can be profiled. The output is folded stacks: one line per distinct
+   stack, outermost caller first, frames separated by ';', then the number
+   of samples, as read by flamegraph.pl and speedscope.
+
+   The copy uses glibc's backtrace(), which is not async-signal-safe: the
+   libgcc unwinder calls dl_iterate_phdr, which takes the dynamic loader's
+   lock. profileStart runs it once so the unwinder is loaded before the
+   first signal, but a sample that lands while the same thread holds that
+   lock (in dlopen or in the loader's thread set-up) deadlocks. The compiler
+   never calls dlopen, so this needs a worker thread being started at the
+   wrong moment; a --profile run that hangs should simply be run again.
+ */
+ 
+ #define MAX_PROFILE_MAPS 64
+ 
+ typedef struct {
+     uintptr_t start, end;      // Run-time address range
+     const char *name;          // Points into the mapped executable
+     int length;                // Name without a ".part.0"-style clone suffix
+ } ProfileSymbol;
+ 
+ ProfileSymbol *profileSymbols = NULL;  // Functions of this executable by start address
+ int profileSymbolCount = 0;
+ ProfileSymbol profileMaps[MAX_PROFILE_MAPS];  // Other executable mappings, e.g. "[libc.so.6]"
+ int profileMapCount = 0;
+ 
+  // Record the stack of the interrupted thread (not async-signal-safe, see above)
+ void profileSignal(int sig) {
+     (void)sig;
+ #ifdef __GLIBC__
+     int saved = errno;
+     int n = __atomic_fetch_add(&profileCount, 1, __ATOMIC_RELAXED);
+     if (n < MAX_PROFILE_SAMPLES) profileDepth[n] = (unsigned char)backtrace(profileFrames[n], MAX_PROFILE_DEPTH);
+     errno = saved;
+ #endif
+ }
+ 
+  // Start sampling; the optimized tier calls this again after the fork
+ void profileStart(void) {
+ #if defined(__linux__) && defined(__GLIBC__)
+     if (!profileFrames) {
+         profileFrames = calloc(MAX_PROFILE_SAMPLES, sizeof(*profileFrames));
+         profileDepth = calloc(MAX_PROFILE_SAMPLES, 1);
+         if (!profileFrames || !profileDepth) {
+             fprintf(stderr, "Error: Out of memory for the profile\n");
+             exit(1);
+         }
+         void *warm[1];
+         backtrace(warm, 1);  // Loads the unwinder now instead of inside the handler
+         struct sigaction action;
+         memset(&action, 0, sizeof(action));
+         action.sa_handler = profileSignal;
+         action.sa_flags = SA_RESTART;
+         sigemptyset(&action.sa_mask);
+         sigaction(SIGPROF, &action, NULL);
+     }
+     profileCount = 0;
+     memset(profileDepth, 0, MAX_PROFILE_SAMPLES);
+     struct itimerval timer;
+     long period = 1000000 / profileHz;  // Microseconds; tv_usec must stay below one second
+     timer.it_interval.tv_sec = period / 1000000;
+     timer.it_interval.tv_usec = period % 1000000;
+     timer.it_value = timer.it_interval;
+     if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+         perror("Error starting the profiling timer");
+         exit(1);
+     }
+ #else
+     fprintf(stderr, "Error: --profile is not supported on this system\n");
+     exit(1);
+ #endif
+ }
+ 
+  // Stop the sampling timer; the handler stays installed for a signal already pending
+ void profileStop(void) {
+ #ifdef __linux__
+     struct itimerval off;
+     memset(&off, 0, sizeof(off));
+     setitimer(ITIMER_PROF, &off, NULL);
+ #endif
+ }
+ 
+  // Order profile symbols by start address
+ int compareProfileSymbols(const void *a, const void *b) {
+     const ProfileSymbol *x = a, *y = b;
+     return x->start < y->start ? -1 : x->start > y->start;
+ }
+ 
+ /*
+   Read the function symbols of the running executable
+   /proc/self/exe is mapped and left mapped, since the names point into it.
+   The full symbol table is used when the binary is not stripped, else the
+   dynamic one. A position-independent executable runs at an offset from
+   the addresses in the file, found from this function's own address; if
+   the function is not in the table, frames are only named by mapping.
+ */
+ void loadProfileSymbols(void) {
+ #ifdef __linux__
+     int fd = open("/proc/self/exe", O_RDONLY);
+     if (fd < 0) return;
+     struct stat st;
+     if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Elf64_Ehdr)) {
+         close(fd);
+         return;
+     }
+     size_t size = st.st_size;
+     const unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+     close(fd);
+     if (map == MAP_FAILED) return;
+ 
+     const Elf64_Ehdr *header = (const Elf64_Ehdr *)map;
+     if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+         header->e_shoff + (uint64_t)header->e_shnum * sizeof(Elf64_Shdr) > size) return;
+     const Elf64_Shdr *sections = (const Elf64_Shdr *)(map + header->e_shoff);
+     const Elf64_Shdr *table = NULL;
+     for (int i = 0; i < header->e_shnum; i++) {
+         if (sections[i].sh_type == SHT_SYMTAB || (sections[i].sh_type == SHT_DYNSYM && !table)) table = &sections[i];
+     }
+     if (!table || table->sh_link >= header->e_shnum) return;
+     const Elf64_Shdr *strings = &sections[table->sh_link];
+     if (table->sh_offset + table->sh_size > size || strings->sh_offset + strings->sh_size > size) return;
+ 
+     const Elf64_Sym *syms = (const Elf64_Sym *)(map + table->sh_offset);
+     int count = table->sh_size / sizeof(Elf64_Sym);
+     profileSymbols = malloc((count + 1) * sizeof(ProfileSymbol));
+     if (!profileSymbols) return;
+     uintptr_t bias = 0;
+     int found = 0;
+     for (int i = 0; i < count; i++) {
+         if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC || syms[i].st_value == 0 || syms[i].st_name >= strings->sh_size) continue;
+         const char *name = (const char *)map + strings->sh_offset + syms[i].st_name;
+         if (strcmp(name, "loadProfileSymbols") == 0) {
+             bias = (uintptr_t)loadProfileSymbols - syms[i].st_value;
+             found = 1;
+         }
+         ProfileSymbol *sym = &profileSymbols[profileSymbolCount++];
+         sym->start = syms[i].st_value;
+         sym->end = sym->start + (syms[i].st_size ? syms[i].st_size : 1);
+         sym->name = name;
+         sym->length = strcspn(name, ".");
+     }
+     if (!found) profileSymbolCount = 0;
+     for (int i = 0; i < profileSymbolCount; i++) {
+         profileSymbols[i].start += bias;
+         profileSymbols[i].end += bias;
+     }
+     qsort(profileSymbols, profileSymbolCount, sizeof(ProfileSymbol), compareProfileSymbols);
+ #endif
+ }
+ 
+  // Remember the executable mappings of shared libraries, to name frames outside this program
+ void loadProfileMaps(void) {
+     static char names[MAX_PROFILE_MAPS][64];
+     FILE *maps = fopen("/proc/self/maps", "r");
+     char line[512];
+     while (maps && profileMapCount < MAX_PROFILE_MAPS && fgets(line, sizeof(line), maps)) {
+         unsigned long start, end;
+         char perms[8];
+         int pathAt = 0;
+         if (sscanf(line, "%lx-%lx %7s %*s %*s %*s %n", &start, &end, perms, &pathAt) < 3 || perms[2] != 'x' || pathAt == 0) continue;
+         line[strcspn(line, "\n")] = '\0';
+         const char *base = strrchr(line + pathAt, '/');
+         base = base ? base + 1 : line + pathAt;
+         if (!*base) continue;
+         ProfileSymbol *map = &profileMaps[profileMapCount];
+         snprintf(names[profileMapCount], sizeof(names[0]), "[%s]", base);
+         map->start = start;
+         map->end = end;
+         map->name = names[profileMapCount++];
+         map->length = strlen(map->name);
+     }
+     if (maps) fclose(maps);
+ }
+ 
+  // Function (or else mapping) containing a code address
+ const ProfileSymbol *profileLookup(uintptr_t pc) {
+     static const ProfileSymbol unknown = { 0, 0, "[unknown]", 9 };
+     int lo = 0, hi = profileSymbolCount - 1;
+     while (lo <= hi) {
+         int mid = (lo + hi) / 2;
+         if (profileSymbols[mid].start <= pc) lo = mid + 1;
+         else hi = mid - 1;
+     }
+     if (hi >= 0 && pc < profileSymbols[hi].end) return &profileSymbols[hi];
+     for (int i = 0; i < profileMapCount; i++) {
+         if (pc >= profileMaps[i].start && pc < profileMaps[i].end) return &profileMaps[i];
+     }
+     return &unknown;
+ }
+ 
+  // qsort comparison of two stack strings
+ int compareStacks(const void *a, const void *b) {
+     return strcmp(*(char *const *)a, *(char *const *)b);
+ }
+ 
+ /*
+   Write the collected samples to the --profile file as folded stacks
+   The first two frames of a sample are the signal handler and the kernel's
+   return trampoline. The interrupted frame is an exact address; the ones
+   above it are return addresses, looked up one byte back so a call at the
+   end of a function is not charged to the next one. Repeated frames of one
+   shared library (its internals) are shown once.
+ */
+ void writeProfile(const char *path) {
+     profileStop();
+     loadProfileSymbols();
+     loadProfileMaps();
+     int count = profileCount < MAX_PROFILE_SAMPLES ? profileCount : MAX_PROFILE_SAMPLES;
+     char **stacks = malloc((count + 1) * sizeof(char *));
+     int stackCount = 0;
+     for (int s = 0; s < count && stacks; s++) {
+         char text[MAX_PROFILE_DEPTH * 64];
+         size_t len = 0;
+         const ProfileSymbol *last = NULL;
+         for (int f = profileDepth[s] - 1; f >= 2 && len < sizeof(text); f--) {
+             uintptr_t pc = (uintptr_t)profileFrames[s][f] - (f > 2);
+             const ProfileSymbol *sym = profileLookup(pc);
+             if (sym == last && sym->name[0] == '[') continue;
+             last = sym;
+             len += snprintf(text + len, sizeof(text) - len, "%s%.*s", len ? ";" : "", sym->length, sym->name);
+         }
+         if (len > 0 && len < sizeof(text)) stacks[stackCount++] = strdup(text);
+     }
+     qsort(stacks, stackCount, sizeof(char *), compareStacks);
+ 
+     FILE *out = fopen(path, profileAppend ? "a" : "w");
+     if (!out) {
+         perror("Error creating profile file");
+         exit(1);
+     }
+     for (int i = 0; i < stackCount; ) {
+         int j = i;
+         while (j < stackCount && strcmp(stacks[j], stacks[i]) == 0) j++;
+         fprintf(out, "%s %d\n", stacks[i], j - i);
+         i = j;
+     }
+     if (fclose(out) != 0) {
+         perror("Error writing profile file");
+         exit(1);
+     }
+     if (profileCount > MAX_PROFILE_SAMPLES) {
+         fprintf(stderr, "Warning: Profile buffer full, %d samples dropped\n", profileCount - MAX_PROFILE_SAMPLES);
+     }
+     for (int i = 0; i < stackCount; i++) free(stacks[i]);
+     free(stacks);
+ }
+ 
+ /*
+   Assembler
+   Encodes the assembly buffer into a machine code image. Data addresses and
+   immediates take one byte. Jumps have a 3-byte absolute form and, on
+   targets that support it, a 2-byte form with a signed 8-bit displacement
+   from the next instruction. A HLT ends the image.
+ */
+ 
+  // Find the encoding of a mnemonic, or NULL
+ const Encoding *findEncoding(const char *op) {
+     for (const Encoding *e = encodings; e->op; e++) {
+         if (strcmp(e->op, op) == 0) return e;
+     }
+     return NULL;
+ }
+ 
+  // Size in bytes of one assembly line with the currently chosen branch form
+ int encodedSize(int index) {
+     const Instr *in = &assembly[index];
+     if (isLabel(in)) return 0;
+     if (isJump(in)) return longBranch[index] ? 3 : 2;
+     if (isTableJump(in)) return 3;
+     if (isTableEntry(in)) return 2;
+     const Encoding *e = findEncoding(in->op);
+     if (!e) {
+         fprintf(stderr, "Error: Cannot encode '%s'\n", in->op);
+         exit(1);
+     }
+     return e->operand == OPERAND_NONE ? 1 : 2;
+ }
+ 
+  // Check whether a line starts a top-level statement and may be pinned
+ int pinnable(int index) {
+     if (index == 0 || assembly[index].line == assembly[index - 1].line || isSkip(&assembly[index - 1])) return 0;
+     for (int s = 0; s < statementCount; s++) {
+         if (statementLines[s] == assembly[index].line) return 1;
+     }
+     return 0;
+ }
+ 
+ /*
+   Assign an address to every line; labels take the address of what follows
+   With --pin, each top-level statement starts on a pin boundary so that
+   edits to one statement leave the addresses of the others alone; the gap
+   is a JMP over 0xFF filler
+ */
+ int layoutCode(void) {
+     int address = codeOrigin;
+     for (int i = 0; i < asmLine; i++) {
+         padStart[i] = -1;
+         if (pinSize > 0 && address % pinSize != 0 && pinnable(i)) {
+             padStart[i] = address;
+             address = (address + 3 + pinSize - 1) / pinSize * pinSize;
+         }
+         instrAddress[i] = address;
+         address += encodedSize(i);
+     }
+     return address;
+ }
+ 
+ /*
+   Branch relaxation
+   Every jump starts in the short form where the target has one. Each round
+   lays the code out again and switches the jumps whose displacement does
+   not fit to the long form. Branches only ever grow, so this terminates,
+   and no branch is longer than it has to be.
+ */
+ int relaxBranches(void) {
+     int rounds = 0, changed = 1;
+     for (int i = 0; i < asmLine; i++) longBranch[i] = !target->hasShortBranch;
+     while (changed) {
+         changed = 0;
+         rounds++;
+         layoutCode();
+         for (int i = 0; i < asmLine; i++) {
+             if (!isJump(&assembly[i]) || longBranch[i]) continue;
+             int labelIndex = findLabel(assembly[i].arg);
+             int displacement = instrAddress[labelIndex] - (instrAddress[i] + 2);
+             if (displacement < -128 || displacement > 127) {
+                 longBranch[i] = 1;
+                 changed = 1;
+             }
+         }
+     }
+     return rounds;
+ }
+ 
+ /*
+   Encode the assembly buffer into the image at codeOrigin
+   Returns the number of relaxation rounds and counts the jump forms
+ */
+ int encodeCode(int *shortCount, int *longCount) {
+     int rounds = relaxBranches();
+     int size = layoutCode();
+     if (size + 1 > MAX_IMAGE) {
+         fprintf(stderr, "Error: Program does not fit in %d bytes of ROM\n", MAX_IMAGE);
+         exit(1);
+     }
+ 
+     for (int i = 0; i < asmLine; i++) {
+         const Instr *in = &assembly[i];
+         if (padStart[i] >= 0) {
+             image[imageSize++] = findEncoding("JMP")->opcode;
+             image[imageSize++] = instrAddress[i] & 0xFF;
+             image[imageSize++] = instrAddress[i] >> 8;
+             while (imageSize < instrAddress[i]) image[imageSize++] = 0xFF;
+         }
+         if (isLabel(in)) continue;
+         if (isJump(in)) {
+             int labelIndex = findLabel(in->arg);
+             if (labelIndex < 0) {
+                 fprintf(stderr, "Error: Jump to undefined label '%s'\n", in->arg);
+                 exit(1);
+             }
+             int destination = instrAddress[labelIndex];
+             char shortName[sizeof(in->op) + 1];
+             snprintf(shortName, sizeof(shortName), "%sS", in->op);
+             if (longBranch[i]) {
+                 image[imageSize++] = findEncoding(in->op)->opcode;
+                 image[imageSize++] = destination & 0xFF;
+                 image[imageSize++] = destination >> 8;
+                 (*longCount)++;
+             } else {
+                 image[imageSize++] = findEncoding(shortName)->opcode;
+                 image[imageSize++] = (destination - (instrAddress[i] + 2)) & 0xFF;
+                 (*shortCount)++;
+             }
+             if (relaxReport) {
+                 fprintf(stderr, "  %04X  %-4s %-6s -> %04X  %s (%d bytes)  line %d\n", instrAddress[i], in->op, in->arg,
+                         destination, longBranch[i] ? "long " : "short", longBranch[i] ? 3 : 2, in->line);
+             }
+             continue;
+         }
+         if (isTableJump(in) || isTableEntry(in)) {
+             // The table address, or one entry of it: a bare 16-bit code address
+             int labelIndex = findLabel(in->arg);
+             if (labelIndex < 0) {
+                 fprintf(stderr, "Error: Jump to undefined label '%s'\n", in->arg);
+                 exit(1);
+             }
+             if (isTableJump(in)) image[imageSize++] = findEncoding(in->op)->opcode;
+             image[imageSize++] = instrAddress[labelIndex] & 0xFF;
+             image[imageSize++] = instrAddress[labelIndex] >> 8;
+             continue;
+         }
+         const Encoding *e = findEncoding(in->op);
+         image[imageSize++] = e->opcode;
+         if (e->operand == OPERAND_BYTE) image[imageSize++] = atoi(in->arg) & 0xFF;
+     }
+     return rounds;
+ }
+ 
+  // Append a data table: runs of [count, address, bytes...] ending with a zero count
+ void encodeTable(const AddrSet *set, const int *values) {
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (!setHas(set, x) || (x > 0 && setHas(set, x - 1))) continue;
+         int count = 0;
+         while (x + count < MAX_ADDRESS && setHas(set, x + count)) count++;
+         image[imageSize++] = count;
+         image[imageSize++] = x;
+         for (int k = 0; k < count; k++) image[imageSize++] = values[x + k];
+     }
+     image[imageSize++] = 0;
+ }
+ 
+ /*
+   Assemble the buffer into image
+   ROM layout: a 16-bit header word (low byte first) holds the address of
+   the data table, or 0 when there is none, and code starts right after it.
+   The table follows the code as runs of [count, address, bytes...] ending
+   with a zero count; the loader copies it to data memory at reset. When
+   inline LDI/STA pairs cost less than the table, they go ahead of the code
+   instead. Reports the form chosen for every jump when relaxReport is set.
+ */
+ void assemble(void) {
+     int useTable = findCost(".TABLE") && initCost(&dataInitSet, 1) < initCost(&dataInitSet, 0);
+     imageSize = 2;
+     for (int x = 0; x < MAX_ADDRESS && !useTable; x++) {
+         if (!setHas(&dataInitSet, x)) continue;
+         image[imageSize++] = findEncoding("LDI")->opcode;
+         image[imageSize++] = dataInit[x];
+         image[imageSize++] = findEncoding("STA")->opcode;
+         image[imageSize++] = x;
+     }
+     codeOrigin = imageSize;
+ 
+     int shortCount = 0, longCount = 0;
+     int rounds = encodeCode(&shortCount, &longCount);
+     image[imageSize++] = findEncoding("HLT")->opcode;
+ 
+     // A stable layout keeps the table on its own page, past the reserved space
+     if (useTable && (deltaPath || pinSize > 0 || reserveSize > 0)) {
+         int tableStart = (imageSize + reserveSize + pageSize - 1) / pageSize * pageSize;
+         if (tableStart + 3 * MAX_ADDRESS > MAX_IMAGE) {
+             fprintf(stderr, "Error: Program does not fit in %d bytes of ROM\n", MAX_IMAGE);
+             exit(1);
+         }
+         while (imageSize < tableStart) image[imageSize++] = 0xFF;
+     }
+ 
+     image[0] = image[1] = 0;
+     if (useTable) {
+         image[0] = imageSize & 0xFF;
+         image[1] = imageSize >> 8;
+         encodeTable(&dataInitSet, dataInit);
+     }
+ 
+     if (relaxReport) {
+         fprintf(stderr, "Branch relaxation on %s: %d short, %d long, %d round(s), %d-byte image\n",
+                 target->name, shortCount, longCount, rounds, imageSize);
+     }
+ }
+ 
+  // Write the assembled image to a binary file
+ void writeImage(const char *path) {
+     char tmpPath[512];
+     snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+     FILE *out = fopen(tmpPath, "wb");
+     if (!out || fwrite(image, 1, imageSize, out) != (size_t)imageSize || fclose(out) != 0 ||
+         rename(tmpPath, path) != 0) {
+         perror("Error writing binary image");
+         exit(1);
+     }
+ }
+ 
+ /*
+   Write the pages that differ from the previous image
+   Both images are compared page by page, with erased flash (0xFF) past
+   their ends. The delta file is a "SLDP" header (version, page size, page
+   count, all 16-bit little endian) followed by the page number and full
+   contents of every changed page. The pages rewritten are reported on stderr.
+ */
+ unsigned char previousImage[MAX_IMAGE];
+ int previousSize = -1;              // Bytes in previousImage, -1 until it is read
+ 
+  // Read the image the device holds; --tiered does this before either tier can replace it
+ void readPreviousImage(const char *previousPath) {
+     FILE *in = fopen(previousPath, "rb");
+     if (!in) {
+         perror("Error opening previous image");
+         exit(1);
+     }
+     previousSize = fread(previousImage, 1, MAX_IMAGE, in);
+     fclose(in);
+ }
+ 
+ void writeDelta(const char *previousPath, const char *path) {
+     static int changed[MAX_IMAGE];
+     const unsigned char *previous = previousImage;
+     if (previousSize < 0) readPreviousImage(previousPath);
+ 
+     int size = imageSize > previousSize ? imageSize : previousSize;
+     int pageCount = (size + pageSize - 1) / pageSize, changedCount = 0;
+     for (int p = 0; p < pageCount; p++) {
+         for (int a = p * pageSize; a < (p + 1) * pageSize; a++) {
+             int now = a < imageSize ? image[a] : 0xFF, before = a < previousSize ? previous[a] : 0xFF;
+             if (now != before) {
+                 changed[changedCount++] = p;
+                 break;
+             }
+         }
+     }
+ 
+     FILE *out = fopen(path, "wb");
+     if (!out) {
+         perror("Error writing delta image");
+         exit(1);
+     }
+     unsigned char header[10] = { 'S', 'L', 'D', 'P', 1, 0, pageSize & 0xFF, pageSize >> 8,
+                                  changedCount & 0xFF, changedCount >> 8 };
+     fwrite(header, 1, sizeof(header), out);
+     for (int c = 0; c < changedCount; c++) {
+         unsigned char number[2] = { changed[c] & 0xFF, changed[c] >> 8 };
+         fwrite(number, 1, 2, out);
+         for (int a = changed[c] * pageSize; a < (changed[c] + 1) * pageSize; a++) fputc(a < imageSize ? image[a] : 0xFF, out);
+     }
+     if (ferror(out) || fclose(out) != 0) {
+         perror("Error writing delta image");
+         exit(1);
+     }
+ 
+     fprintf(stderr, "Delta against %s: %d of %d %d-byte pages rewritten", previousPath, changedCount, pageCount, pageSize);
+     for (int c = 0; c < changedCount; c++) fprintf(stderr, "%s%d", c ? " " : ": ", changed[c]);
+     fprintf(stderr, "\n");
+ }
+ 
+ /*
+   Simulator
+   Runs the assembled image with the cycle costs of the target. The loader
+   copies the ROM data table to data memory first. Devices sit at the data
+   addresses given on the command line:
+     UART   ADDR reads the next input byte (0 at the end) and writes an
+            output byte; ADDR+1 reads 1 while input is waiting
+     timer  ADDR and ADDR+1 read the low and high byte of the cycle count
+            divided by the prescaler; a write to ADDR restarts it
+     GPIO   ADDR reads back the last value written; each write is logged
+            with the cycle it happened on
+ */
+ #define MAX_DEVICES 8
+ typedef struct {
+     char kind;                 // 'u' UART, 't' timer, 'g' GPIO
+     int address;
+     int prescale;              // Timer: cycles per tick
+     long start;                // Timer: cycle of the last restart
+     int value;                 // GPIO: last value written
+     FILE *in, *out;            // UART input and output, GPIO log
+ } Device;
+ 
+ Device devices[MAX_DEVICES];
+ int deviceCount = 0;
+ int simulate = 0;                   // --simulate
+ long simCycleLimit = 100000000;     // --sim-cycles=N
+ long simCycles = 0;                 // Cycles executed so far
+ long simEnergy = 0;                 // Estimated energy so far, in pJ
+ unsigned char simMemory[MAX_ADDRESS];
+ 
+ /*
+   Add a device from a command line spec: ADDR[,FILE[,FILE]] for the UART,
+   ADDR[,PRESCALE] for the timer and ADDR[,LOGFILE] for GPIO
+ */
+ void addDevice(char kind, const char *spec) {
+     if (deviceCount >= MAX_DEVICES) {
+         fprintf(stderr, "Error: Too many devices\n");
+         exit(1);
+     }
+     char copy[512], *field[3] = { NULL, NULL, NULL };
+     snprintf(copy, sizeof(copy), "%s", spec);
+     field[0] = strtok(copy, ",");
+     field[1] = field[0] ? strtok(NULL, ",") : NULL;
+     field[2] = field[1] ? strtok(NULL, ",") : NULL;
+     Device *d = &devices[deviceCount++];
+     memset(d, 0, sizeof(*d));
+     d->kind = kind;
+     d->address = field[0] ? atoi(field[0]) : -1;
+     if (d->address < 0 || d->address >= MAX_ADDRESS) {
+         fprintf(stderr, "Error: Device address must be 0 to %d\n", MAX_ADDRESS - 1);
+         exit(1);
+     }
+     for (int a = d->address; a < d->address + (kind == 'g' ? 1 : 2) && a < MAX_ADDRESS; a++) {
+         setAdd(&reservedCells, a);  // Never handed out to a variable or temporary
+     }
+     if (kind == 'u') {
+         d->in = field[1] ? fopen(field[1], "rb") : NULL;
+         d->out = field[2] ? fopen(field[2], "wb") : stdout;
+         if ((field[1] && !d->in) || !d->out) {
+             perror("Error opening UART file");
+             exit(1);
+         }
+     } else if (kind == 't') {
+         d->prescale = field[1] ? atoi(field[1]) : 1;
+         if (d->prescale <= 0) d->prescale = 1;
+     } else {
+         d->out = field[1] ? fopen(field[1], "w") : stderr;
+         if (!d->out) {
+             perror("Error opening GPIO log");
+             exit(1);
+         }
+     }
+ }
+ 
+  // Find the device register at a data address, and which of its registers it is
+ Device *findDevice(int address, int *offset) {
+     for (int i = 0; i < deviceCount; i++) {
+         int span = devices[i].kind == 'g' ? 1 : 2;
+         if (address >= devices[i].address && address < devices[i].address + span) {
+             *offset = address - devices[i].address;
+             return &devices[i];
+         }
+     }
+     return NULL;
+ }
+ 
+ int simRead(int address) {
+     int offset;
+     Device *d = findDevice(address, &offset);
+     if (!d) return simMemory[address];
+     if (d->kind == 'g') return d->value;
+     if (d->kind == 't') {
+         long ticks = (simCycles - d->start) / d->prescale;
+         return (offset ? ticks >> 8 : ticks) & 0xFF;
+     }
+     int c = d->in ? fgetc(d->in) : EOF;
+     if (offset == 0) return c == EOF ? 0 : c;
+     if (c != EOF) ungetc(c, d->in);
+     return c != EOF;
+ }
+ 
+ void simWrite(int address, int value) {
+     int offset;
+     Device *d = findDevice(address, &offset);
+     if (!d) {
+         simMemory[address] = value;
+     } else if (d->kind == 'u' && offset == 0) {
+         fputc(value, d->out);
+     } else if (d->kind == 't' && offset == 0) {
+         d->start = simCycles;
+     } else if (d->kind == 'g') {
+         d->value = value;
+         fprintf(d->out, "cycle %ld: gpio %d = %d\n", simCycles, address, value);
+     }
+ }
+ 
+  // Decode the opcode at a code address
+ const Encoding *decodeAt(int pc) {
+     for (const Encoding *e = encodings; e->op; e++) {
+         if (pc < imageSize && e->opcode == image[pc]) return e;
+     }
+     fprintf(stderr, "Error: Illegal opcode at %04X\n", pc);
+     exit(1);
+ }
+ 
+ int operandSize(const Encoding *e) {
+     return e->operand == OPERAND_ABS16 ? 2 : e->operand == OPERAND_NONE ? 0 : 1;
+ }
+ 
+ // Account for one operation of the cost table
+ void simCharge(const char *op, int times) {
+     const OpCost *c = findCost(op);
+     simCycles += (long)times * (c ? c->cycles : 1);
+     simEnergy += (long)times * (c ? c->energy : target->stallEnergy);
+ }
+ 
+ /*
+   Run the image until HLT or the cycle limit
+   Reports instructions, cycles, estimated energy and the final value of
+   every variable
+ */
+ void runSimulator(void) {
+     long steps = 0;
+     int acc = 0, zero = 0, carry = 0;
+     memset(simMemory, 0, sizeof(simMemory));
+     simCycles = simEnergy = 0;
+ 
+     // Loader: copy the data table
+     int table = image[0] | image[1] << 8;
+     if (table) {
+         simCharge(".TABLE", 1);
+         while (table < imageSize && image[table] != 0) {
+             int count = image[table], address = image[table + 1];
+             simCharge(".RUN", 1);
+             simCharge(".BYTE", count);
+             for (int k = 0; k < count; k++) simMemory[(address + k) % MAX_ADDRESS] = image[table + 2 + k];
+             table += 2 + count;
+         }
+     }
+     long loaderCycles = simCycles, loaderEnergy = simEnergy;
+ 
+     int pc = 2;
+     while (1) {
+         if (simCycles >= simCycleLimit) {
+             fprintf(stderr, "Simulation stopped after %ld cycles\n", simCycles);
+             break;
+         }
+         const Encoding *e = decodeAt(pc);
+         if (e->opcode == 0xFF) break;  // HLT
+         int operand = e->operand == OPERAND_ABS16 ? image[pc + 1] | image[pc + 2] << 8 : image[pc + 1];
+         int next = pc + 1 + operandSize(e);
+         char op[8];
+         snprintf(op, sizeof(op), "%s", e->op);
+         if (e->operand == OPERAND_REL8) {
+             op[strlen(op) - 1] = '\0';  // Short jumps cost what the long ones do
+             operand = next + (signed char)operand;
+         }
+         simCharge(op, 1);
+         steps++;
+ 
+         if (strcmp(op, "LDI") == 0) acc = operand;
+         else if (strcmp(op, "LDA") == 0) acc = simRead(operand);
+         else if (strcmp(op, "STA") == 0) simWrite(operand, acc);
+         else if (strncmp(op, "ADD", 3) == 0 || strncmp(op, "SUB", 3) == 0 ||
+                  strncmp(op, "ADC", 3) == 0 || strncmp(op, "SBC", 3) == 0) {
+             // The carry is set by an unsigned overflow, or by a borrow for a subtraction
+             int value = op[3] == 'I' ? operand : simRead(operand);
+             int carryIn = strncmp(op, "ADC", 3) == 0 || strncmp(op, "SBC", 3) == 0 ? carry : 0;
+             int result = op[0] == 'A' ? acc + value + carryIn : acc - value - carryIn;
+             acc = result & 0xFF;
+             zero = acc == 0;
+             carry = result < 0 || result > 255;
+         } else if (strcmp(op, "SKZ") == 0 || strcmp(op, "SKNZ") == 0) {
+             if (zero == (strcmp(op, "SKZ") == 0)) {
+                 next += 1 + operandSize(decodeAt(next));
+                 simCycles += 1;
+                 simEnergy += target->stallEnergy;
+             }
+         } else if (strcmp(op, "JMP") == 0 || (strcmp(op, "JZ") == 0 && zero) || (strcmp(op, "JNZ") == 0 && !zero) ||
+                    (strcmp(op, "JC") == 0 && carry) || (strcmp(op, "JNC") == 0 && !carry) || strcmp(op, "JMPT") == 0) {
+             int entry = operand + 2 * acc;
+             next = strcmp(op, "JMPT") == 0 ? image[entry] | image[entry + 1] << 8 : operand;
+             simCycles += target->branchPenalty;
+             simEnergy += target->branchPenalty * target->stallEnergy;
+         }
+         pc = next;
+     }
+ 
+     fprintf(stderr, "Simulated %ld instructions in %ld cycles on %s (%ld in the loader)\n",
+             steps, simCycles, target->name, loaderCycles);
+     fprintf(stderr, "Estimated energy: %.3f nJ (%.3f nJ in the loader)\n", simEnergy / 1000.0, loaderEnergy / 1000.0);
+     for (int i = 0; i < varCount; i++) {
+         if (!vars[i].isVolatile && isVariable(vars[i].address)) fprintf(stderr, "  %s = %d\n", vars[i].name, simMemory[vars[i].address]);
+     }
+     for (int i = 0; i < deviceCount; i++) {
+         if (devices[i].in) fclose(devices[i].in);
+         if (devices[i].out && devices[i].out != stdout && devices[i].out != stderr) fclose(devices[i].out);
+     }
+ }
+ 
+ /*
+   Backend for 8080-class CPUs
+   Lowers the accumulator code to 8080 assembly. Variables and temporaries
+   are assigned to the registers B, C, D and E by a graph-coloring
+   allocator; HL is kept free to address the cells left in memory. A
+   variable in a register is loaded once at entry if it is read before it
+   is written, and every store that may be the last one before the program
+   ends is also written through to its memory address.
+ */
+ 
+ /*
+   Per-instruction analysis for register allocation
+   Read-liveness (exit needs nothing) builds the interference graph, and
+   reach-exit liveness decides which stores must also go to memory
+ */
+ void analyzeRegisters(int *writeThrough, AddrSet *entryLive) {
+     static AddrSet readIn[MAX_CODE_LINES], exitIn[MAX_CODE_LINES];
+     AddrSet allVars = {{0}};
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (isVariable(x)) setAdd(&allVars, x);
+     }
+     requireAnalysis(ANALYSIS_CFG);
+     memset(readIn, 0, blockCount * sizeof(AddrSet));
+     memset(exitIn, 0, blockCount * sizeof(AddrSet));
+ 
+     // Both analyses to a fixed point, then one last walk records the results
+     for (int final = 0, changed = 1; final < 2; final += !changed) {
+         changed = 0;
+         for (int b = blockCount - 1; b >= 0; b--) {
+             AddrSet live = {{0}}, reach = blocks[b].succCount == 0 ? allVars : (AddrSet){{0}};
+             for (int e = 0; e < blocks[b].succCount; e++) {
+                 int s = cfgEdges[blocks[b].succStart + e];
+                 for (int w = 0; w < MAX_ADDRESS / 64; w++) {
+                     live.bits[w] |= readIn[s].bits[w];
+                     reach.bits[w] |= exitIn[s].bits[w];
+                 }
+             }
+             for (int i = blocks[b].end - 1; i >= blocks[b].start; i--) {
+                 const Instr *in = &assembly[i];
+                 if (isOp(in, "STA")) {
+                     int x = atoi(in->arg);
+                     if (final) {
+                         writeThrough[i] = setHas(&reach, x);
+                         for (int y = 0; y < MAX_ADDRESS; y++) {
+                             if (y != x && setHas(&live, y)) interference[x][y] = interference[y][x] = 1;
+                         }
+                     }
+                     setRemove(&live, x);
+                     setRemove(&reach, x);
+                 } else if (readsAddress(in, atoi(in->arg))) {
+                     setAdd(&live, atoi(in->arg));
+                 }
+             }
+             if (memcmp(&live, &readIn[b], sizeof(live)) || memcmp(&reach, &exitIn[b], sizeof(reach))) changed = 1;
+             readIn[b] = live;
+             exitIn[b] = reach;
+         }
+         if (final) break;
+     }
+     *entryLive = blockCount > 0 ? readIn[0] : (AddrSet){{0}};
+ 
+     // Everything loaded at entry is live at the same time
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         for (int y = 0; y < MAX_ADDRESS; y++) {
+             if (x != y && setHas(entryLive, x) && setHas(entryLive, y)) interference[x][y] = 1;
+         }
+     }
+ }
+ 
+ /*
+   Graph coloring (Chaitin-Briggs)
+   Cells with fewer neighbours than there are registers are removed first;
+   when none is left, the cell with the lowest uses-per-neighbour is pushed
+   optimistically. Popping the stack assigns the lowest free register, and
+   a cell whose neighbours took them all stays in memory.
+ */
+ void colorRegisters(const int *uses) {
+     int stack[MAX_ADDRESS], removed[MAX_ADDRESS] = {0}, degree[MAX_ADDRESS] = {0};
+     int depth = 0, nodes = 0;
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         regOf[x] = -1;
+         if (!uses[x] || isVolatile(x)) removed[x] = 1;
+         else nodes++;
+         for (int y = 0; y < MAX_ADDRESS; y++) degree[x] += interference[x][y] && uses[y] && !isVolatile(y);
+     }
+ 
+     while (depth < nodes) {
+         int pick = -1;
+         for (int x = 0; x < MAX_ADDRESS && pick < 0; x++) {
+             if (!removed[x] && degree[x] < target->registers) pick = x;
+         }
+         if (pick < 0) {
+             // Spill candidate: cheapest to keep in memory per conflict removed
+             for (int x = 0; x < MAX_ADDRESS; x++) {
+                 if (removed[x]) continue;
+                 if (pick < 0 || uses[x] * degree[pick] < uses[pick] * degree[x]) pick = x;
+             }
+         }
+         removed[pick] = 1;
+         stack[depth++] = pick;
+         for (int y = 0; y < MAX_ADDRESS; y++) {
+             if (interference[pick][y]) degree[y]--;
+         }
+     }
+ 
+     while (depth > 0) {
+         int x = stack[--depth], taken = 0;
+         for (int y = 0; y < MAX_ADDRESS; y++) {
+             if (interference[x][y] && regOf[y] >= 0) taken |= 1 << regOf[y];
+         }
+         for (int r = 0; r < target->registers && regOf[x] < 0; r++) {
+             if (!(taken & (1 << r))) regOf[x] = r;
+         }
+     }
+ }
+ 
+ /*
+   Write the program as 8080 assembly
+   Same labels and control flow as the accumulator code; only the way
+   variables are reached changes
+ */
+ void write8080(FILE *out) {
+     static int writeThrough[MAX_CODE_LINES];
+     int uses[MAX_ADDRESS] = {0}, firstLine[MAX_ADDRESS] = {0};
+     AddrSet entryLive;
+     memset(interference, 0, sizeof(interference));
+     for (int i = 0; i < asmLine; i++) {
+         const Instr *in = &assembly[i];
+         if (isOp(in, "STA") || readsAddress(in, atoi(in->arg))) {
+             if (!uses[atoi(in->arg)]++) firstLine[atoi(in->arg)] = in->line;
+         }
+         else if (!isLabel(in) && !refersToLabel(in) && !isOp(in, "LDI") && !isOp(in, "ADDI") && !isOp(in, "SUBI") &&
+                  !isOp(in, "ADCI") && !isOp(in, "SBCI")) {
+             fprintf(stderr, "Error: '%s' cannot be lowered to %s\n", in->op, target->name);
+             exit(1);
+         }
+     }
+     analyzeRegisters(writeThrough, &entryLive);
+     colorRegisters(uses);
+ 
+     // Allocation summary as a comment, then the entry loads
+     fprintf(out, "; registers:");
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (uses[x] && regOf[x] >= 0) fprintf(out, " %s=%c", varName(x), regNames[regOf[x]]);
+     }
+     fprintf(out, "\n; memory:");
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (uses[x] && regOf[x] < 0) fprintf(out, " %s=%d", varName(x), x);
+     }
+     fprintf(out, "\n");
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (regOf[x] >= 0 && setHas(&entryLive, x)) fprintf(out, "LDA %d\nMOV %c,A\n", x, regNames[regOf[x]]);
+     }
+ 
+     for (int i = 0; i < asmLine; i++) {
+         const Instr *in = &assembly[i];
+         int x = atoi(in->arg);
+         if (isLabel(in)) fprintf(out, "%s:\n", in->arg);
+         else if (isJump(in)) fprintf(out, "%s %s\n", in->op, in->arg);
+         else if (isTableEntry(in)) fprintf(out, "DW %s\n", in->arg);
+         else if (isTableJump(in)) {
+             // HL = table + 2 * A, then jump to the address stored there; B-E are left alone
+             fprintf(out, "MOV L,A\nMVI H,0\nDAD H\nMOV A,L\nADI %s AND 0FFH\nMOV L,A\nMOV A,H\nACI %s SHR 8\nMOV H,A\n",
+                     in->arg, in->arg);
+             fprintf(out, "MOV A,M\nINX H\nMOV H,M\nMOV L,A\nPCHL\n");
+         } else if (isOp(in, "LDI")) fprintf(out, "MVI A,%d\n", x & 0xFF);
+         else if (isOp(in, "ADDI")) fprintf(out, "ADI %d\n", x & 0xFF);
+         else if (isOp(in, "SUBI")) fprintf(out, "SUI %d\n", x & 0xFF);
+         else if (isOp(in, "ADCI")) fprintf(out, "ACI %d\n", x & 0xFF);
+         else if (isOp(in, "SBCI")) fprintf(out, "SBI %d\n", x & 0xFF);
+         else if (isOp(in, "LDA")) {
+             if (regOf[x] >= 0) fprintf(out, "MOV A,%c\n", regNames[regOf[x]]);
+             else fprintf(out, "LDA %d\n", x);
+         } else if (isOp(in, "STA")) {
+             if (regOf[x] >= 0) fprintf(out, "MOV %c,A\n", regNames[regOf[x]]);
+             if (regOf[x] < 0 || writeThrough[i]) fprintf(out, "STA %d\n", x);
+         } else {
+             // ADD/SUB/ADC/SBC with a memory operand; the 8080 calls SBC "SBB"
+             const char *op = isOp(in, "SBC") ? "SBB" : in->op;
+             if (regOf[x] >= 0) fprintf(out, "%s %c\n", op, regNames[regOf[x]]);
+             else fprintf(out, "LXI H,%d\n%s M\n", x, op);
+         }
+     }
+     fprintf(out, "HLT\n");
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (setHas(&dataInitSet, x)) fprintf(out, "ORG %d\nDB %d\n", x, dataInit[x]);
+     }
+ 
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         char message[200];
+         if (!uses[x]) continue;
+         if (regOf[x] >= 0) {
+             snprintf(message, sizeof(message), "%s kept in register %c, %d references", varName(x), regNames[regOf[x]], uses[x]);
+             writeRemark("regalloc", "RegisterAssigned", firstLine[x], NULL, message);
+         } else {
+             snprintf(message, sizeof(message), "%s left in memory at %d, %d references", varName(x), x, uses[x]);
+             writeRemark("regalloc", "Spilled", firstLine[x], isVolatile(x) ? "memory-mapped variable"
+                         : "every register holds a value live at the same time", message);
+         }
+     }
+ }
+ 
+ /*
+   Write output.asm
+   The data image as .DATA lines, then every assembly line of the program
+ */
+ void writeAssembly(FILE *out) {
+     for (int x = 0; x < MAX_ADDRESS && !target->registers; x++) {
+         if (setHas(&dataInitSet, x)) fprintf(out, ".DATA %d %d\n", x, dataInit[x]);
+     }
+     if (target->registers) {
+         write8080(out);
+         return;
+     }
+     for (int i = 0; i < asmLine; i++) {
+         char text[200];
+         formatInstr(&assembly[i], text, sizeof(text));
+         fprintf(out, "%s\n", text);
+     }
+ }
+ 
+ /*
+   Checkpoint the symbol table into the warm state file
+   Keeps every symbol from the mapped state plus the ones added in this run,
+   so addresses stay stable across restarts and source edits
+ */
+ void saveState(const char *path) {
+     const StateHeader *old = (const StateHeader *)stateMap;
+     uint32_t oldCount = old ? old->symbolCount : 0;
+     uint32_t count = oldCount;
+ 
+     // Collect names and addresses: previous state first, then new variables
+     const char **names = malloc((oldCount + varCount + 1) * sizeof(char *));
+     int32_t *addresses = malloc((oldCount + varCount + 1) * sizeof(int32_t));
+     for (uint32_t i = 0; i < oldCount; i++) {
+         const StateSymbol *sym = (const StateSymbol *)(stateMap + old->symbolsOffset) + i;
+         names[i] = (const char *)(stateMap + old->stringsOffset + sym->nameOffset);
+         addresses[i] = sym->address;
+     }
+     for (int i = 0; i < varCount; i++) {
+         if (vars[i].isVolatile || stateLookup(vars[i].name) >= 0) continue;  // Device registers are bound in the source
+         names[count] = vars[i].name;
+         addresses[count++] = vars[i].address;
+     }
+ 
+     // Size the hash index at a load factor of at most one half
+     uint32_t bucketCount = 8;
+     while (bucketCount < count * 2) bucketCount *= 2;
+     uint32_t stringsSize = 0;
+     for (uint32_t i = 0; i < count; i++) stringsSize += strlen(names[i]) + 1;
+ 
+     StateHeader hdr;
+     memcpy(hdr.magic, STATE_MAGIC, 4);
+     hdr.version = STATE_VERSION;
+     hdr.symbolCount = count;
+     hdr.bucketCount = bucketCount;
+     hdr.symbolsOffset = sizeof(StateHeader);
+     hdr.bucketsOffset = hdr.symbolsOffset + count * sizeof(StateSymbol);
+     hdr.stringsOffset = hdr.bucketsOffset + bucketCount * sizeof(uint32_t);
+     hdr.fileSize = hdr.stringsOffset + stringsSize + 1;
+ 
+     unsigned char *image = calloc(1, hdr.fileSize);
+     memcpy(image, &hdr, sizeof(hdr));
+     StateSymbol *syms = (StateSymbol *)(image + hdr.symbolsOffset);
+     uint32_t *buckets = (uint32_t *)(image + hdr.bucketsOffset);
+     uint32_t nameOffset = 0;
+     for (uint32_t i = 0; i < count; i++) {
+         syms[i].nameOffset = nameOffset;
+         syms[i].address = addresses[i];
+         strcpy((char *)image + hdr.stringsOffset + nameOffset, names[i]);
+         nameOffset += strlen(names[i]) + 1;
+ 
+         uint32_t b = hashName(names[i]) & (bucketCount - 1);
+         while (buckets[b] != 0) b = (b + 1) & (bucketCount - 1);
+         buckets[b] = i + 1;
+     }
+ 
+     // Write to a temporary file and rename so a concurrent reader never sees a partial file
+     char tmpPath[1024];
+     snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+     FILE *out = fopen(tmpPath, "wb");
+     if (!out || fwrite(image, 1, hdr.fileSize, out) != hdr.fileSize || fclose(out) != 0 ||
+         rename(tmpPath, path) != 0) {
+         perror("Error writing state file");
+         exit(1);
+     }
+     free(image);
+     free(names);
+     free(addresses);
+ }
+ 
+ /*
+   Binary IR
+   The instruction stream as fixed-size records. Mnemonics, label and
+   variable names live once in a string table; jumps name their target by
+   index into the label table. Symbols and the data image travel along, so
+   the file is a complete program.
+ */
+ 
+  // Add a string to the IR string table, reusing an identical one
+ uint32_t irString(char *strings, uint32_t *size, const char *text) {
+     for (uint32_t at = 0; at < *size; at += strlen(strings + at) + 1) {
+         if (strcmp(strings + at, text) == 0) return at;
+     }
+     uint32_t at = *size;
+     strcpy(strings + at, text);
+     *size += strlen(text) + 1;
+     return at;
+ }
+ 
+  // Check whether an operand is a plain decimal number
+ int isNumber(const char *text) {
+     const char *p = text + (*text == '-');
+     if (!*p) return 0;
+     for (; *p; p++) {
+         if (!isdigit((unsigned char)*p)) return 0;
+     }
+     return 1;
+ }
+ 
+ void writeIR(const char *path) {
+     uint32_t labelCount = 0, dataCount = 0;
+     for (int i = 0; i < asmLine; i++) labelCount += isLabel(&assembly[i]);
+     for (int x = 0; x < MAX_ADDRESS; x++) dataCount += setHas(&dataInitSet, x);
+ 
+     IrHeader hdr;
+     memset(&hdr, 0, sizeof(hdr));
+     memcpy(hdr.magic, IR_MAGIC, 4);
+     hdr.version = IR_VERSION;
+     hdr.instrCount = asmLine;
+     hdr.labelCount = labelCount;
+     hdr.symbolCount = varCount;
+     hdr.dataCount = dataCount;
+     hdr.instrOffset = sizeof(IrHeader);
+     hdr.labelsOffset = hdr.instrOffset + asmLine * sizeof(IrInstr);
+     hdr.symbolsOffset = hdr.labelsOffset + labelCount * sizeof(IrLabel);
+     hdr.dataOffset = hdr.symbolsOffset + varCount * sizeof(IrSymbol);
+     hdr.stringsOffset = (hdr.dataOffset + dataCount * sizeof(IrData) + 3) & ~3u;
+ 
+     // Every string is at most one per instruction and symbol
+     char *strings = calloc(1, (asmLine * 2 + varCount + 1) * MAX_TOKEN_LEN);
+     uint32_t stringsSize = 1;  // Offset 0 is the empty string
+     IrInstr *instrs = calloc(asmLine + 1, sizeof(IrInstr));
+     IrLabel *labels = calloc(labelCount + 1, sizeof(IrLabel));
+     int *labelIndex = calloc(asmLine + 1, sizeof(int));
+ 
+     int next = 0;
+     for (int i = 0; i < asmLine; i++) {
+         if (!isLabel(&assembly[i])) continue;
+         labels[next].nameOffset = irString(strings, &stringsSize, assembly[i].arg);
+         labels[next].instrIndex = i;
+         labelIndex[i] = next++;
+     }
+     for (int i = 0; i < asmLine; i++) {
+         const Instr *in = &assembly[i];
+         IrInstr *ir = &instrs[i];
+         ir->line = in->line;
+         if (isLabel(in)) {
+             ir->kind = IR_LABEL;
+             ir->operand = labelIndex[i];
+             continue;
+         }
+         ir->opOffset = irString(strings, &stringsSize, in->op);
+         int target = refersToLabel(in) ? findLabel(in->arg) : -1;
+         if (target >= 0) {
+             ir->kind = IR_LABEL;
+             ir->operand = labelIndex[target];
+         } else if (!in->arg[0]) {
+             ir->kind = IR_NONE;
+         } else if (isNumber(in->arg)) {
+             ir->kind = IR_NUMBER;
+             ir->operand = atoi(in->arg);
+         } else {
+             ir->kind = IR_TEXT;
+             ir->operand = irString(strings, &stringsSize, in->arg);
+         }
+     }
+ 
+     IrSymbol *symbols = calloc(varCount + 1, sizeof(IrSymbol));
+     for (int v = 0; v < varCount; v++) {
+         symbols[v].nameOffset = irString(strings, &stringsSize, vars[v].name);
+         symbols[v].address = vars[v].address;
+         symbols[v].isVolatile = vars[v].isVolatile;
+     }
+     hdr.fileSize = hdr.stringsOffset + stringsSize;
+ 
+     unsigned char *image = calloc(1, hdr.fileSize);
+     memcpy(image, &hdr, sizeof(hdr));
+     memcpy(image + hdr.instrOffset, instrs, asmLine * sizeof(IrInstr));
+     memcpy(image + hdr.labelsOffset, labels, labelCount * sizeof(IrLabel));
+     memcpy(image + hdr.symbolsOffset, symbols, varCount * sizeof(IrSymbol));
+     IrData *data = (IrData *)(image + hdr.dataOffset);
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (setHas(&dataInitSet, x)) *data++ = (IrData){ x, dataInit[x] };
+     }
+     memcpy(image + hdr.stringsOffset, strings, stringsSize);
+ 
+     char tmpPath[1024];
+     snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+     FILE *out = fopen(tmpPath, "wb");
+     if (!out || fwrite(image, 1, hdr.fileSize, out) != hdr.fileSize || fclose(out) != 0 ||
+         rename(tmpPath, path) != 0) {
+         perror("Error writing IR file");
+         exit(1);
+     }
+     free(image);
+     free(symbols);
+     free(labelIndex);
+     free(labels);
+     free(instrs);
+     free(strings);
+ }
+ 
+  // Check that a string table offset names a string shorter than limit
+ int irStringOk(const IrHeader *ir, uint32_t offset, size_t limit) {
+     uint32_t size = ir->fileSize - ir->stringsOffset;
+     return offset < size && strnlen((const char *)ir + ir->stringsOffset + offset, size - offset) < limit;
+ }
+ 
+  // Check that a table of count records fits in the file and is aligned
+ int irTableOk(const IrHeader *ir, uint32_t offset, uint32_t count, size_t record) {
+     return offset % 4 == 0 && offset >= sizeof(IrHeader) && offset + (uint64_t)count * record <= ir->stringsOffset;
+ }
+ 
+ /*
+   Map an IR file and validate it
+   Every count, offset, index and string is checked once here, so readers
+   can index the mapped records directly afterwards. Exits on a bad file.
+ */
+ const IrHeader *mapIR(const char *path) {
+     int fd = open(path, O_RDONLY);
+     struct stat st;
+     if (fd < 0 || fstat(fd, &st) != 0) {
+         perror("Error opening IR file");
+         exit(1);
+     }
+     if (st.st_size < (off_t)sizeof(IrHeader)) {
+         fprintf(stderr, "Error: IR file '%s' is truncated\n", path);
+         exit(1);
+     }
+     void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+     close(fd);
+     if (map == MAP_FAILED) {
+         perror("Error mapping IR file");
+         exit(1);
+     }
+ 
+     const IrHeader *ir = map;
+     const unsigned char *base = map;
+     int ok = memcmp(ir->magic, IR_MAGIC, 4) == 0 && ir->version == IR_VERSION &&
+              ir->fileSize == (uint64_t)st.st_size && ir->stringsOffset < ir->fileSize &&
+              base[ir->fileSize - 1] == '\0' && base[ir->stringsOffset] == '\0' &&
+              ir->instrCount <= MAX_CODE_LINES && ir->symbolCount <= MAX_VARS &&
+              irTableOk(ir, ir->instrOffset, ir->instrCount, sizeof(IrInstr)) &&
+              irTableOk(ir, ir->labelsOffset, ir->labelCount, sizeof(IrLabel)) &&
+              irTableOk(ir, ir->symbolsOffset, ir->symbolCount, sizeof(IrSymbol)) &&
+              irTableOk(ir, ir->dataOffset, ir->dataCount, sizeof(IrData));
+     const IrInstr *instrs = (const IrInstr *)(base + ir->instrOffset);
+     const IrLabel *labels = (const IrLabel *)(base + ir->labelsOffset);
+     const IrSymbol *symbols = (const IrSymbol *)(base + ir->symbolsOffset);
+     const IrData *data = (const IrData *)(base + ir->dataOffset);
+     for (uint32_t l = 0; ok && l < ir->labelCount; l++) {
+         ok = irStringOk(ir, labels[l].nameOffset, MAX_TOKEN_LEN) && labels[l].instrIndex < ir->instrCount;
+     }
+     for (uint32_t i = 0; ok && i < ir->instrCount; i++) {
+         const IrInstr *in = &instrs[i];
+         ok = irStringOk(ir, in->opOffset, sizeof(((Instr *)0)->op)) && in->kind <= IR_TEXT &&
+              (in->kind != IR_LABEL || (uint32_t)in->operand < ir->labelCount) &&
+              (in->kind != IR_TEXT || irStringOk(ir, in->operand, MAX_TOKEN_LEN)) &&
+              (in->opOffset != 0 || (in->kind == IR_LABEL && labels[in->operand].instrIndex == i));
+     }
+     for (uint32_t v = 0; ok && v < ir->symbolCount; v++) {
+         ok = irStringOk(ir, symbols[v].nameOffset, MAX_TOKEN_LEN) &&
+              symbols[v].address >= 0 && symbols[v].address < MAX_ADDRESS;
+     }
+     for (uint32_t d = 0; ok && d < ir->dataCount; d++) {
+         ok = data[d].address < MAX_ADDRESS && data[d].value < 256;
+     }
+     if (!ok) {
+         fprintf(stderr, "Error: '%s' is not a valid version %d IR file\n", path, IR_VERSION);
+         exit(1);
+     }
+     return ir;
+ }
+ 
+ /*
+   Compile from an IR file instead of source
+   The records are read straight from the mapping into the code buffer,
+   which the optimizer then rewrites
+ */
+ void loadIR(const char *path) {
+     const IrHeader *ir = mapIR(path);
+     const char *base = (const char *)ir;
+     const char *strings = base + ir->stringsOffset;
+     const IrInstr *instrs = (const IrInstr *)(base + ir->instrOffset);
+     const IrLabel *labels = (const IrLabel *)(base + ir->labelsOffset);
+     const IrSymbol *symbols = (const IrSymbol *)(base + ir->symbolsOffset);
+     const IrData *data = (const IrData *)(base + ir->dataOffset);
+ 
+     for (uint32_t v = 0; v < ir->symbolCount; v++) {
+         strcpy(vars[v].name, strings + symbols[v].nameOffset);
+         vars[v].address = symbols[v].address;
+         vars[v].isVolatile = symbols[v].isVolatile != 0;
+     }
+     varCount = ir->symbolCount;
+     for (uint32_t d = 0; d < ir->dataCount; d++) {
+         dataInit[data[d].address] = data[d].value;
+         setAdd(&dataInitSet, data[d].address);
+     }
+     for (uint32_t i = 0; i < ir->instrCount; i++) {
+         Instr *in = &assembly[i];
+         snprintf(in->op, sizeof(in->op), "%s", strings + instrs[i].opOffset);
+         if (instrs[i].kind == IR_LABEL) {
+             const char *name = strings + labels[instrs[i].operand].nameOffset;
+             snprintf(in->arg, sizeof(in->arg), "%s", name);
+             if (name[0] == 'L' && atoi(name + 1) >= labelCount) labelCount = atoi(name + 1) + 1;
+         } else if (instrs[i].kind == IR_NUMBER) {
+             snprintf(in->arg, sizeof(in->arg), "%d", instrs[i].operand);
+             if ((isOp(in, "STA") || readsAddress(in, instrs[i].operand)) && instrs[i].operand >= 0 && instrs[i].operand < MAX_ADDRESS) {
+                 setAdd(&reservedCells, instrs[i].operand);  // Keep temporaries clear of cells already in use
+             }
+         } else if (instrs[i].kind == IR_TEXT) {
+             snprintf(in->arg, sizeof(in->arg), "%s", strings + instrs[i].operand);
+         } else {
+             in->arg[0] = '\0';
+         }
+         in->line = instrs[i].line;
+     }
+     asmLine = ir->instrCount;
+     munmap((void *)ir, ir->fileSize);
+ }
+ 
+ /*
+   ROM packer (--pack=A.ir,B.ir,... --bin=ROM)
+   Links separately compiled programs into one image. Data cells are either
+   moved apart so the programs can share memory (disjoint) or left where
+   they are for programs that never run together (overlay); device
+   registers always stay put. Identical tails (the code from some point to
+   the HLT, with jumps that stay inside it) are kept once and the other
+   programs jump into that copy; identical data tables are stored once.
+   Packed layout: a directory [count, then per program its entry address
+   and data table address (0 if none), 16-bit low byte first], the code,
+   then the tables.
+ */
+ #define MAX_PACKED 16
+ typedef struct {
+     const char *path;
+     Instr code[MAX_CODE_LINES];  // Program with its labels renamed, ending in HLT
+     int length;
+     int standalone;              // Image size when assembled on its own
+     int data[MAX_ADDRESS];       // Initial data image
+     AddrSet dataSet;
+     AddrSet cells, devices;      // Data cells it uses, and those that are device registers
+     int cut;                     // Code from here on is shared, == length if not
+     int shareWith, shareAt;      // Program and line holding the shared copy
+     int tableAddress;
+ } PackedProgram;
+ 
+ const char *packList = NULL;        // --pack=FILE[,FILE...], IR files to link into one ROM
+ int packOverlay = 0;                // --pack-data=overlay, programs share data addresses
+ PackedProgram packed[MAX_PACKED];
+ int packedCount = 0;
+ 
+  // Check whether an instruction's operand is a data address
+ int takesAddress(const Instr *in) {
+     return isOp(in, "STA") || readsAddress(in, atoi(in->arg));
+ }
+ 
+ int findLabelIn(const PackedProgram *p, const char *label) {
+     for (int i = 0; i < p->length; i++) {
+         if (isLabel(&p->code[i]) && strcmp(p->code[i].arg, label) == 0) return i;
+     }
+     return -1;
+ }
+ 
+  // Bytes of a stretch of packed code, counting every jump in its long form
+ int packedBytes(const PackedProgram *p, int from, int to) {
+     int bytes = 0;
+     for (int i = from; i < to; i++) {
+         const Instr *in = &p->code[i];
+         if (isLabel(in)) continue;
+         bytes += isJump(in) || isTableJump(in) ? 3 : isTableEntry(in) ? 2 : findEncoding(in->op)->operand == OPERAND_NONE ? 1 : 2;
+     }
+     return bytes;
+ }
+ 
+ /*
+   Longest tail of a that b ends with as well
+   Jumps must land at the same distance from the end in both, inside the
+   tail, and the tail may not start right after a skip or inside a jump table
+ */
+ int tailMatch(const PackedProgram *a, const PackedProgram *b) {
+     int n = a->length, m = b->length, lowest = n, best = 0;
+     for (int len = 1; len <= n && len <= m; len++) {
+         const Instr *x = &a->code[n - len], *y = &b->code[m - len];
+         if (strcmp(x->op, y->op) != 0) break;
+         if (refersToLabel(x)) {
+             int tx = findLabelIn(a, x->arg), ty = findLabelIn(b, y->arg);
+             if (tx < 0 || ty < 0 || tx - n != ty - m) break;
+             if (tx < lowest) lowest = tx;
+         } else if (!isLabel(x) && strcmp(x->arg, y->arg) != 0) {
+             break;
+         }
+         if (lowest >= n - len && (len == n || !isSkip(&a->code[n - len - 1])) && !isTableEntry(x)) best = len;
+     }
+     return best;
+ }
+ 
+  // Follow shared tails to the program and line that really hold a line
+ void resolveShared(int *program, int *line) {
+     while (*line >= packed[*program].cut) {
+         const PackedProgram *p = &packed[*program];
+         *line = p->shareAt + (*line - p->cut);
+         *program = p->shareWith;
+     }
+ }
+ 
+  // Load one program and measure its standalone image
+ void loadPacked(PackedProgram *p, const char *path) {
+     asmLine = varCount = labelCount = 0;
+     currentAddress = 16;
+     memset(&dataInitSet, 0, sizeof(dataInitSet));
+     loadIR(path);
+     assemble();
+ 
+     memset(p, 0, sizeof(*p));
+     p->path = path;
+     p->standalone = imageSize;
+     for (int i = 0; i < asmLine; i++) {
+         Instr *in = &p->code[p->length++];
+         *in = assembly[i];
+         if (isLabel(in) || refersToLabel(in)) snprintf(in->arg, sizeof(in->arg), "P%d_%.90s", packedCount, assembly[i].arg);
+         if (takesAddress(in)) setAdd(&p->cells, atoi(in->arg));
+     }
+     if (p->length >= MAX_CODE_LINES) {
+         fprintf(stderr, "Error: Too many lines of assembly in '%s'\n", path);
+         exit(1);
+     }
+     p->code[p->length++] = (Instr){ "HLT", "", 0 };
+     p->dataSet = dataInitSet;
+     memcpy(p->data, dataInit, sizeof(p->data));
+     for (int x = 0; x < MAX_ADDRESS; x++) {
+         if (setHas(&dataInitSet, x)) setAdd(&p->cells, x);
+     }
+     for (int v = 0; v < varCount; v++) {
+         setAdd(&p->cells, vars[v].address);
+         if (vars[v].isVolatile) setAdd(&p->devices, vars[v].address);
+     }
+ }
+ 
+ /*
+   Place the data cells of every program
+   Device registers keep their address in every program. Disjoint packing
+   gives each program its own cells past those of the programs before it.
+ */
+ void placePackedData(void) {
+     AddrSet devices = { { 0 } };
+     for (int p = 0; p < packedCount; p++) {
+         for (int x = 0; x < MAX_ADDRESS; x++) {
+             if (setHas(&packed[p].devices, x)) setAdd(&devices, x);
+         }
+     }
+     int next = 16;
+     for (int p = 0; p < packedCount; p++) {
+         PackedProgram *prog = &packed[p];
+         int map[MAX_ADDRESS];
+         for (int x = 0; x < MAX_ADDRESS; x++) {
+             map[x] = x;
+             if (!setHas(&prog->cells, x) || setHas(&prog->devices, x)) continue;
+             if (packOverlay && setHas(&devices, x)) {
+                 fprintf(stderr, "Error: '%s' keeps data in cell %d, a device register of another program\n",
+                         prog->path, x);
+                 exit(1);
+             }
+             if (packOverlay) continue;
+             while (next < MAX_ADDRESS && setHas(&devices, next)) next++;
+             if (next >= MAX_ADDRESS) {
+                 fprintf(stderr, "Error: The packed programs need more than %d data cells; try --pack-data=overlay\n",
+                         MAX_ADDRESS);
+                 exit(1);
+             }
+             map[x] = next++;
+         }
+ 
+         AddrSet dataSet = { { 0 } };
+         int data[MAX_ADDRESS] = { 0 };
+         for (int x = 0; x < MAX_ADDRESS; x++) {
+             if (!setHas(&prog->dataSet, x)) continue;
+             setAdd(&dataSet, map[x]);
+             data[map[x]] = prog->data[x];
+         }
+         for (int i = 0; i < prog->length; i++) {
+             Instr *in = &prog->code[i];
+             if (takesAddress(in)) snprintf(in->arg, sizeof(in->arg), "%d", map[atoi(in->arg)]);
+         }
+         prog->dataSet = dataSet;
+         memcpy(prog->data, data, sizeof(data));
+     }
+ }
+ 
+  // Build the combined code buffer, with the shared tails and entry labels
+ void linkPacked(void) {
+     static int marked[MAX_PACKED][MAX_CODE_LINES];  // Line starts a shared tail
+     memset(marked, 0, sizeof(marked));
+     for (int p = 0; p < packedCount; p++) {
+         packed[p].cut = packed[p].length;
+         int bestLength = 0, bestWith = -1;
+         for (int q = 0; q < p; q++) {
+             int length = tailMatch(&packed[p], &packed[q]);
+             if (length > bestLength) {
+                 bestLength = length;
+                 bestWith = q;
+             }
+         }
+         int cut = packed[p].length - bestLength;
+         int jump = cut > 0 ? 3 : 0;
+         if (bestWith < 0 || packedBytes(&packed[p], cut, packed[p].length) <= jump) continue;
+         int program = bestWith, line = packed[bestWith].length - bestLength;
+         resolveShared(&program, &line);
+         packed[p].cut = cut;
+         packed[p].shareWith = program;
+         packed[p].shareAt = line;
+     }
+ 
+     // Jumps into a dropped tail go to the same line of the shared copy
+     for (int p = 0; p < packedCount; p++) {
+         PackedProgram *prog = &packed[p];
+         for (int i = 0; i < prog->cut; i++) {
+             Instr *in = &prog->code[i];
+             int targetLine = refersToLabel(in) ? findLabelIn(prog, in->arg) : -1;
+             int program = p;
+             if (targetLine < prog->cut) continue;
+             resolveShared(&program, &targetLine);
+             marked[program][targetLine] = 1;
+             snprintf(in->arg, sizeof(in->arg), "P%d_T%d", program, targetLine);
+         }
+         if (prog->cut < prog->length) marked[prog->shareWith][prog->shareAt] = 1;
+     }
+ 
+     asmLine = 0;
+     for (int p = 0; p < packedCount; p++) {
+         PackedProgram *prog = &packed[p];
+         if (prog->cut > 0) {
+             snprintf(assembly[asmLine].arg, sizeof(assembly[asmLine].arg), "P%d_T0", p);
+             assembly[asmLine].op[0] = '\0';
+             asmLine++;
+         }
+         for (int i = 0; i < prog->cut; i++) {
+             if (asmLine + 3 > MAX_CODE_LINES) {
+                 fprintf(stderr, "Error: Too many lines of assembly\n");
+                 exit(1);
+             }
+             if (marked[p][i] && i > 0) {
+                 assembly[asmLine] = (Instr){ "", "", prog->code[i].line };
+                 snprintf(assembly[asmLine++].arg, MAX_TOKEN_LEN, "P%d_T%d", p, i);
+             }
+             assembly[asmLine++] = prog->code[i];
+         }
+         if (prog->cut > 0 && prog->cut < prog->length) {
+             assembly[asmLine] = (Instr){ "JMP", "", 0 };
+             snprintf(assembly[asmLine++].arg, MAX_TOKEN_LEN, "P%d_T%d", prog->shareWith, prog->shareAt);
+         }
+     }
+ }
+ 
+ void packPrograms(void) {
+     char list[1024];
+     snprintf(list, sizeof(list), "%s", packList);
+     for (char *path = strtok(list, ","); path; path = strtok(NULL, ",")) {
+         if (packedCount == MAX_PACKED) {
+             fprintf(stderr, "Error: At most %d programs can be packed\n", MAX_PACKED);
+             exit(1);
+         }
+         char *name = strdup(path);
+         loadPacked(&packed[packedCount++], name);
+     }
+     placePackedData();
+     linkPacked();
+ 
+     // Directory, code, then the data tables with duplicates stored once
+     int shortCount = 0, longCount = 0;
+     imageSize = codeOrigin = 1 + 4 * packedCount;
+     encodeCode(&shortCount, &longCount);
+     int codeEnd = imageSize, tableBytes = 0;
+     for (int p = 0; p < packedCount; p++) {
+         PackedProgram *prog = &packed[p];
+         int hasData = 0;
+         for (int x = 0; x < MAX_ADDRESS; x++) hasData |= setHas(&prog->dataSet, x);
+         prog->tableAddress = 0;
+         if (!hasData) continue;
+         int start = imageSize;
+         encodeTable(&prog->dataSet, prog->data);
+         prog->tableAddress = start;
+         for (int q = 0; q < p; q++) {
+             int size = imageSize - start;
+             if (packed[q].tableAddress > 0 && packed[q].tableAddress + size <= start &&
+                 memcmp(image + packed[q].tableAddress, image + start, size) == 0) {
+                 prog->tableAddress = packed[q].tableAddress;
+                 imageSize = start;
+                 break;
+             }
+         }
+         tableBytes += imageSize - start;
+     }
+ 
+     image[0] = packedCount;
+     int total = 0;
+     fprintf(stderr, "ROM packing (%s data), %d programs:\n", packOverlay ? "overlay" : "disjoint", packedCount);
+     for (int p = 0; p < packedCount; p++) {
+         PackedProgram *prog = &packed[p];
+         int program = p, line = 0;
+         resolveShared(&program, &line);
+         char entry[MAX_TOKEN_LEN];
+         snprintf(entry, sizeof(entry), "P%d_T%d", program, line);
+         int address = instrAddress[findLabel(entry)];
+         image[1 + 4 * p] = address & 0xFF;
+         image[2 + 4 * p] = address >> 8;
+         image[3 + 4 * p] = prog->tableAddress & 0xFF;
+         image[4 + 4 * p] = prog->tableAddress >> 8;
+         total += prog->standalone;
+ 
+         fprintf(stderr, "  %-20s %5d bytes alone, entry %04X", prog->path, prog->standalone, address);
+         if (prog->cut < prog->length) {
+             fprintf(stderr, ", shares its last %d bytes with %s", packedBytes(prog, prog->cut, prog->length),
+                     packed[prog->shareWith].path);
+         }
+         fprintf(stderr, "\n");
+     }
+     fprintf(stderr, "  Code %d bytes, data tables %d bytes, directory %d bytes\n",
+             codeEnd - codeOrigin, tableBytes, codeOrigin);
+     fprintf(stderr, "  Packed image %d bytes, %d bytes as separate images: %d bytes saved\n",
+             imageSize, total, total - imageSize);
+ }
+ 
+ // Samples read back from the previous --metrics file, so counters and histograms accumulate 
+ #define MAX_SERIES 64
+ struct {
+     char series[128];          // Metric name with its labels, as written
+     double value;
+ } previousSamples[MAX_SERIES];
+ int previousCount = 0;
+ 
+  // Read every sample line of the previous metrics file; a missing file counts from zero
+ void readPreviousMetrics(const char *path) {
+     FILE *in = fopen(path, "r");
+     char line[256];
+     previousCount = 0;
+     while (in && previousCount < MAX_SERIES && fgets(line, sizeof(line), in)) {
+         if (line[0] == '#') continue;
+         if (sscanf(line, "%127s %lf", previousSamples[previousCount].series, &previousSamples[previousCount].value) == 2) {
+             previousCount++;
+         }
+     }
+     if (in) fclose(in);
+ }
+ 
+  // Value a series had in the previous file, 0 if it was not there
+ double previousSample(const char *series) {
+     for (int i = 0; i < previousCount; i++) {
+         if (strcmp(previousSamples[i].series, series) == 0) return previousSamples[i].value;
+     }
+     return 0;
+ }
+ 
+ /*
+   Write one metric family in Prometheus text exposition format
+   Counters and gauges carry a single unlabelled sample; a counter continues
+   from its previous value, a gauge describes the last compilation
+ */
+ void writeMetric(FILE *out, const char *name, const char *type, const char *help, double value) {
+     if (strcmp(type, "counter") == 0) value += previousSample(name);
+     fprintf(out, "# HELP %s %s\n", name, help);
+     fprintf(out, "# TYPE %s %s\n", name, type);
+     fprintf(out, "%s %.9g\n", name, value);
+ }
+ 
+  // Write one histogram sample, added to its previous value
+ void writeHistogramSample(FILE *out, const char *series, double value) {
+     fprintf(out, "%s %.9g\n", series, value + previousSample(series));
+ }
+ 
+ /*
+   Write all metrics to the --metrics file
+   Counters and histograms add this compilation to the totals already in
+   the file, so a series of runs builds up rates and latency distributions.
+   A lock file serializes concurrent runs, and the file is replaced
+   atomically so a textfile collector never reads a partial scrape.
+ */
+ void writeMetrics(const char *path) {
+     const double buckets[] = { 0.0001, 0.001, 0.01, 0.1, 1 };
+     const int bucketCount = sizeof(buckets) / sizeof(buckets[0]);
+     char tmpPath[1024], lockPath[1024], series[128];
+ 
+     snprintf(lockPath, sizeof(lockPath), "%s.lock", path);
+     int lock = open(lockPath, O_RDWR | O_CREAT, 0644);
+     if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+         perror("Error locking metrics file");
+         exit(1);
+     }
+     readPreviousMetrics(path);
+ 
+     snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+     FILE *out = fopen(tmpPath, "w");
+     if (!out) {
+         perror("Error creating metrics file");
+         exit(1);
+     }
+ 
+     writeMetric(out, "simplelang_compiles_total", "counter",
+                 "Number of compilations performed.", metricValues[METRIC_COMPILES]);
+     writeMetric(out, "simplelang_tokens_total", "counter",
+                 "Tokens produced by the lexer.", metricValues[METRIC_TOKENS]);
+     writeMetric(out, "simplelang_statements_total", "counter",
+                 "Statements compiled.", metricValues[METRIC_STATEMENTS]);
+     writeMetric(out, "simplelang_instructions_total", "counter",
+                 "Assembly lines emitted.", metricValues[METRIC_INSTRUCTIONS]);
+     writeMetric(out, "simplelang_state_hits_total", "counter",
+                 "Variables whose address was reused from the warm state file.", metricValues[METRIC_STATE_HITS]);
+     writeMetric(out, "simplelang_tokens_per_second", "gauge",
+                 "Lexer and parser throughput over the parse phase.",
+                 phaseSeconds[PHASE_PARSE] > 0 ? metricValues[METRIC_TOKENS] / phaseSeconds[PHASE_PARSE] : 0);
+     writeMetric(out, "simplelang_arena_bytes", "gauge",
+                 "Bytes in use in the assembly buffer and symbol table.",
+                 (double)asmLine * sizeof(assembly[0]) + (double)varCount * sizeof(vars[0]));
+ 
+     // Per-phase latency histogram
+     fprintf(out, "# HELP simplelang_phase_duration_seconds Compile latency by phase.\n");
+     fprintf(out, "# TYPE simplelang_phase_duration_seconds histogram\n");
+     for (int p = 0; p < PHASE_COUNT; p++) {
+         for (int b = 0; b < bucketCount; b++) {
+             snprintf(series, sizeof(series), "simplelang_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"}",
+                      phaseNames[p], buckets[b]);
+             writeHistogramSample(out, series, phaseSeconds[p] <= buckets[b]);
+         }
+         snprintf(series, sizeof(series), "simplelang_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"}", phaseNames[p]);
+         writeHistogramSample(out, series, 1);
+         snprintf(series, sizeof(series), "simplelang_phase_duration_seconds_sum{phase=\"%s\"}", phaseNames[p]);
+         writeHistogramSample(out, series, phaseSeconds[p]);
+         snprintf(series, sizeof(series), "simplelang_phase_duration_seconds_count{phase=\"%s\"}", phaseNames[p]);
+         writeHistogramSample(out, series, 1);
+     }
+     if (fclose(out) != 0 || rename(tmpPath, path) != 0) {
+         perror("Error writing metrics file");
+         exit(1);
+     }
+     close(lock);  // Releases the lock
+ }
+ 
+ /*
+   Tiered compilation (--tiered[=MS])
+   Forks once the program is parsed. The first tier carries on without the
+   optimizer, so the unoptimized output is written at once. The second runs
+   at low priority with a deadline for the optimizer, waits for the first
+   to finish, then replaces its outputs. Without fork everything is
+   optimized in one process as usual.
+ */
+ void startTiers(void) {
+     if (pipe(tierPipe) != 0) return;
+     if (deltaPath) readPreviousImage(deltaPath);  // The first tier replaces it before the second diffs
+     fflush(NULL);  // Nothing buffered may be written by both processes
+     pid_t pid = fork();
+     if (pid < 0) {
+         close(tierPipe[0]);
+         close(tierPipe[1]);
+         return;
+     }
+     if (pid > 0) {
+         close(tierPipe[0]);  // The write end closes when this process exits
+         tier = 1;
+         optimizeLevel = 0;
+         if (remarksFile) fclose(remarksFile);  // Remarks come from the optimized tier
+         remarksFile = NULL;
+         return;
+     }
+     close(tierPipe[1]);
+     tier = 2;
+     (void)setpriority(PRIO_PROCESS, 0, 10);  // Leave the CPU to interactive work
+     optDeadline = nowSeconds() + tierBudget / 1000.0;
+     statePath = metricsPath = NULL;  // Recorded by the first tier
+     if (profilePath) {
+         profileAppend = 1;  // Written after the first tier's samples
+         profileStart();     // Timers do not survive fork
+     }
+ }
+ 
+  // Block until the first tier has written its outputs
+ void waitForFirstTier(void) {
+     char c;
+     ssize_t n;
+     while ((n = read(tierPipe[0], &c, 1)) > 0 || (n < 0 && errno == EINTR)) {}
+     close(tierPipe[0]);
+ }
+ 
+ /*
+   Look up the variables named by --live-out
+   A q8_8 variable brings its high byte along (also when the program came
+   from IR, which has no types). Memory-mapped variables are kept by every
+   pass anyway, so naming one is allowed but changes nothing.
+ */
+ void resolveLiveOut(void) {
+     char copy[1024];
+     snprintf(copy, sizeof(copy), "%s", liveOutList);
+     for (char *name = strtok(copy, ","); name; name = strtok(NULL, ",")) {
+         int found = 0;
+         for (int i = 0; i < varCount; i++) {
+             size_t len = strlen(name);
+             if (strncmp(vars[i].name, name, len) != 0 || (vars[i].name[len] && strcmp(vars[i].name + len, ".hi") != 0)) continue;
+             setAdd(&liveOutSet, vars[i].address);
+             found = 1;
+         }
+         if (!found) {
+             fprintf(stderr, "Error: --live-out names unknown variable '%s'\n", name);
+             exit(1);
+         }
+     }
+ }
+ 
+ /*
+   Parse command line options
+   Every option is optional; with none the compiler behaves as before
+ */
+ void parseOptions(int argc, char *argv[]) {
+     for (int i = 1; i < argc; i++) {
+         if (strncmp(argv[i], "--metrics=", 10) == 0) {
+             metricsPath = argv[i] + 10;
+         } else if (strncmp(argv[i], "--state=", 8) == 0) {
+             statePath = argv[i] + 8;
+         } else if (strcmp(argv[i], "-O") == 0 || strcmp(argv[i], "-O1") == 0) {
+             optimizeLevel = 1;
+         } else if (strcmp(argv[i], "-Oenergy") == 0) {
+             optimizeLevel = 1;
+             optimizeEnergy = 1;
+         } else if (strcmp(argv[i], "-O0") == 0) {
+             optimizeLevel = 0;
+         } else if (strncmp(argv[i], "--remarks=", 10) == 0) {
+             remarksFile = fopen(argv[i] + 10, "w");
+             if (!remarksFile) {
+                 perror("Error creating remarks file");
+                 exit(1);
+             }
+         } else if (strncmp(argv[i], "--remarks-filter=", 17) == 0) {
+             remarksFilter = argv[i] + 17;
+         } else if (strncmp(argv[i], "--target=", 9) == 0) {
+             target = NULL;
+             for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+                 if (strcmp(targets[t].name, argv[i] + 9) == 0) target = &targets[t];
+             }
+             if (!target) {
+                 fprintf(stderr, "Error: Unknown target '%s'\n", argv[i] + 9);
+                 exit(1);
+             }
+         } else if (strncmp(argv[i], "--opt-bisect-limit=", 19) == 0) {
+             optBisectLimit = atoi(argv[i] + 19);
+         } else if (strncmp(argv[i], "--bin=", 6) == 0) {
+             binPath = argv[i] + 6;
+         } else if (strncmp(argv[i], "--delta=", 8) == 0) {
+             deltaPath = argv[i] + 8;
+         } else if (strncmp(argv[i], "--page-size=", 12) == 0) {
+             pageSize = atoi(argv[i] + 12);
+             if (pageSize <= 0 || pageSize > 4096) {
+                 fprintf(stderr, "Error: Page size must be 1 to 4096 bytes\n");
+                 exit(1);
+             }
+         } else if (strncmp(argv[i], "--pin=", 6) == 0) {
+             pinSize = atoi(argv[i] + 6);
+         } else if (strncmp(argv[i], "--reserve=", 10) == 0) {
+             reserveSize = atoi(argv[i] + 10);
+         } else if (strcmp(argv[i], "--simulate") == 0) {
+             simulate = 1;
+         } else if (strncmp(argv[i], "--sim-cycles=", 13) == 0) {
+             simCycleLimit = atol(argv[i] + 13);
+         } else if (strncmp(argv[i], "--uart=", 7) == 0) {
+             addDevice('u', argv[i] + 7);
+         } else if (strncmp(argv[i], "--timer=", 8) == 0) {
+             addDevice('t', argv[i] + 8);
+         } else if (strncmp(argv[i], "--gpio=", 7) == 0) {
+             addDevice('g', argv[i] + 7);
+         } else if (strcmp(argv[i], "--relax-report") == 0) {
+             relaxReport = 1;
+         } else if (strcmp(argv[i], "--partial-eval") == 0) {
+             partialEval = 1;
+         } else if (strncmp(argv[i], "--partial-eval=", 15) == 0) {
+             partialEval = 1;
+             peBudget = atoi(argv[i] + 15);
+         } else if (strcmp(argv[i], "--time-report") == 0) {
+             timeReport = 1;
+         } else if (strncmp(argv[i], "--emit-ir=", 10) == 0) {
+             emitIrPath = argv[i] + 10;
+         } else if (strncmp(argv[i], "--load-ir=", 10) == 0) {
+             loadIrPath = argv[i] + 10;
+         } else if (strncmp(argv[i], "--pack=", 7) == 0) {
+             packList = argv[i] + 7;
+         } else if (strcmp(argv[i], "--pack-data=overlay") == 0) {
+             packOverlay = 1;
+         } else if (strcmp(argv[i], "--pack-data=disjoint") == 0) {
+             packOverlay = 0;
+         } else if (strcmp(argv[i], "--tiered") == 0) {
+             tierBudget = 2000;
+         } else if (strncmp(argv[i], "--tiered=", 9) == 0) {
+             tierBudget = atoi(argv[i] + 9);
+             if (tierBudget <= 0) {
+                 fprintf(stderr, "Error: --tiered needs a positive time in milliseconds\n");
+                 exit(1);
+             }
+         } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+             profilePath = argv[i] + 10;
+         } else if (strncmp(argv[i], "--profile-hz=", 13) == 0) {
+             profileHz = atoi(argv[i] + 13);
+             if (profileHz < 1 || profileHz > 10000) {
+                 fprintf(stderr, "Error: --profile-hz must be 1 to 10000\n");
+                 exit(1);
+             }
+         } else if (strcmp(argv[i], "--perf-counters") == 0) {
+             timeReport = perfCounters = 1;
+         } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+             jobs = atoi(argv[i] + 7);
+             if (jobs < 1 || jobs > 64) {
+                 fprintf(stderr, "Error: --jobs must be 1 to 64\n");
+                 exit(1);
+             }
+         } else if (strncmp(argv[i], "--live-out=", 11) == 0) {
+             liveOutList = argv[i] + 11;
+         } else {
+             fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+             exit(1);
+         }
+     }
+     if (deltaPath && !binPath) {
+         fprintf(stderr, "Error: --delta needs --bin\n");
+         exit(1);
+     }
+     if (simulate && tierBudget > 0) {
+         // Both tiers would run it, the second after the prompt has returned
+         fprintf(stderr, "Error: --simulate cannot be combined with --tiered\n");
+         exit(1);
+     }
+ }
+ 
+
+ #ifndef SIMPLELANG_NO_MAIN  // The benchmarks in bench/ include this file with their own main
+ int main(int argc, char *argv[]) {
+     printf("SimpleLang Compiler\n");
+     parseOptions(argc, argv);
+     if (statePath) loadState(statePath);
+     
+     // Packing links compiled programs; nothing is compiled from source
+     if (packList) {
+         if (!binPath || target->registers) {
+             fprintf(stderr, "Error: --pack needs --bin and a target with a machine code encoder\n");
+             return 1;
+         }
+         packPrograms();
+         if (deltaPath) {
+             char path[512];
+             snprintf(path, sizeof(path), "%s.delta", binPath);
+             writeDelta(deltaPath, path);
+         }
+         writeImage(binPath);
+         printf("Packed ROM written to %s\n", binPath);
+         return 0;
+     }
+ 
+     FILE *file = loadIrPath ? NULL : fopen("input.sl", "r");
+     if (!file && !loadIrPath) {
+         perror("Error opening file");
+         return 1;
+     }
+ 
+     // Perform compilation, or pick up a compiled program
+     if (perfCounters) perfOpen();
+     if (profilePath) profileStart();
+     beginPhase();
+     if (file) {
+         compile(file);
+         fclose(file);
+     } else {
+         loadIR(loadIrPath);
+     }
+     if (liveOutList) resolveLiveOut();
+     metricAdd(METRIC_COMPILES, 1);
+     endPhase(PHASE_PARSE);
+     if (tierBudget > 0 && optimizeLevel > 0) startTiers();
+ 
+     // Optimize the generated code
+     beginPhase();
+     if (partialEval) partialEvaluate();
+     if (optimizeLevel > 0) optimize();
+     endPhase(PHASE_OPTIMIZE);
+ 
+     // Encode machine code when an image was asked for
+     beginPhase();
+     if ((binPath || relaxReport || simulate) && target->registers) {
+         fprintf(stderr, "Error: No machine code encoder for target %s\n", target->name);
+         return 1;
+     }
+     if (binPath || relaxReport || simulate) assemble();
+     endPhase(PHASE_ASSEMBLE);
+ 
+     // Write assembly output, replacing the file in one step
+     if (tier == 2) waitForFirstTier();
+     beginPhase();
+     FILE *out = fopen("output.asm.tmp", "w");
+     if (!out) {
+         perror("Error creating output file");
+         return 1;
+     }
+ 
+     writeAssembly(out);
+     if (fclose(out) != 0 || rename("output.asm.tmp", "output.asm") != 0) {
+         perror("Error writing output file");
+         return 1;
+     }
+     if (remarksFile) fclose(remarksFile);
+     if (deltaPath) {
+         char path[512];
+         snprintf(path, sizeof(path), "%s.delta", binPath);
+         writeDelta(deltaPath, path);  // Before the image, which may replace the previous one
+     }
+     if (binPath) writeImage(binPath);
+     if (emitIrPath) writeIR(emitIrPath);
+     endPhase(PHASE_OUTPUT);
+     if (profilePath) writeProfile(profilePath);
+ 
+     if (simulate) runSimulator();
+ 
+     if (timeReport) printTimeReport();
+     if (statePath) saveState(statePath);
+     if (metricsPath) writeMetrics(metricsPath);
+ 
+     if (tier == 2) {
+         printf("Optimized tier written to output.asm%s\n", deadlineHit ? " (optimizer stopped at the deadline)" : "");
+     } else {
+         printf("Compilation successful! Assembly written to output.asm%s\n",
+                tier == 1 ? "; optimizing in the background" : "");
+     }
      return 0;
  }
+ #endif